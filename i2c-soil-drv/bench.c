@@ -0,0 +1,221 @@
+/**************************************************************************
+ *
+ * bench.c
+ *
+ * In-kernel read benchmark for the i2c soil moisture driver, for
+ * measuring bus and sensor performance on deployed units, and comparing
+ * conv_delay_us and max_rereads settings, without syscall noise.
+ *
+ * Writing N to /sys/class/i2c-soil-drv/<dev>/bench runs N back-to-back
+ * reads, with the usual retries, on the bus worker. In sim mode and on
+ * virtual sensors the reads are simulated. bench_result then reports
+ * throughput, the latency distribution and the error and re-read
+ * counts, as "name value" lines.
+ *
+ * Like a burst capture, the run holds the bus worker, so other sensors
+ * on the same bus are not sampled until it finishes. Runs therefore
+ * end after I2C_SOIL_MAX_BENCH_MS whatever N is, and writing 0 to
+ * bench stops one early; the results cover the reads taken.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/sysfs.h>
+
+#include "i2c-soil-drv-int.h"
+
+static int i2c_soil_bench_cmp(const void *a, const void *b)
+{
+    u32 lat_a = *(const u32 *)a;
+    u32 lat_b = *(const u32 *)b;
+
+    return (lat_a > lat_b) - (lat_a < lat_b);
+}
+
+/*
+ * Take bench_len full reads (i2c_soil_drv_read_sensor, as acquisition
+ * does) back to back, timing each one, for at most
+ * I2C_SOIL_MAX_BENCH_MS. The latencies are sorted at the end, ready
+ * for percentiles.
+ */
+static void i2c_soil_bench_work(struct kthread_work *work)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(work, struct i2c_soil_dev, bench_work);
+    unsigned int rereads;
+    ktime_t run_start, run_end, start;
+    ssize_t reading;
+    unsigned int i;
+
+    run_start = ktime_get();
+    run_end = ktime_add_ms(run_start, I2C_SOIL_MAX_BENCH_MS);
+    for (i = 0; i < p_dev->bench_len; i++) {
+	if (READ_ONCE(p_dev->bench_abort) || ktime_after(ktime_get(), run_end)) {
+	    break;
+	}
+
+	rereads = 0;
+	start = ktime_get();
+	if (p_dev->virtual_dev) {
+	    reading = i2c_soil_vsensor_value(p_dev);
+	} else if (READ_ONCE(p_dev->use_simulation)) {
+	    reading = READ_ONCE(p_dev->sim_data);
+	} else {
+	    reading = i2c_soil_drv_read_sensor(p_dev, &rereads);
+	}
+	p_dev->p_bench_lat[i] =
+	    min_t(u64, ktime_to_ns(ktime_sub(ktime_get(), start)), U32_MAX);
+	p_dev->bench_rereads += rereads;
+	if (reading < 0) {
+	    p_dev->bench_errors++;
+	}
+	WRITE_ONCE(p_dev->bench_done, i + 1);
+    }
+    p_dev->bench_elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), run_start));
+
+    sort(p_dev->p_bench_lat, i, sizeof(u32), i2c_soil_bench_cmp, NULL);
+
+    /* Results are visible before the state says done */
+    smp_store_release(&p_dev->bench_running, 0);
+}
+
+void i2c_soil_bench_init(struct i2c_soil_dev *p_dev)
+{
+    mutex_init(&p_dev->bench_lock);
+    kthread_init_work(&p_dev->bench_work, i2c_soil_bench_work);
+}
+
+/* Abort any run in progress and free the results */
+void i2c_soil_bench_cleanup(struct i2c_soil_dev *p_dev)
+{
+    WRITE_ONCE(p_dev->bench_abort, 1);
+    kthread_cancel_work_sync(&p_dev->bench_work);
+    kvfree(p_dev->p_bench_lat);
+    p_dev->p_bench_lat = NULL;
+}
+
+/*
+ * Writing N starts an N read run, replacing the previous results; 0
+ * stops the running one.
+ */
+static ssize_t bench_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    u32 *p_bench_lat;
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if (!val) {
+	mutex_lock(&p_dev->bench_lock);
+	i2c_soil_drv_stop_run(p_dev->bench_running, &p_dev->bench_abort,
+			      NULL, &p_dev->bench_work);
+	mutex_unlock(&p_dev->bench_lock);
+	return count;
+    }
+    if (val > I2C_SOIL_MAX_BENCH) {
+	return -EINVAL;
+    }
+    if ((retval = i2c_soil_probe_ready(p_dev)) < 0) {
+	return retval;		/* No bus worker yet, or ever */
+    }
+
+    p_bench_lat = kvcalloc(val, sizeof(u32), GFP_KERNEL);
+    if (!p_bench_lat) {
+	return -ENOMEM;
+    }
+
+    mutex_lock(&p_dev->bench_lock);
+    if (p_dev->bench_running) {
+	mutex_unlock(&p_dev->bench_lock);
+	kvfree(p_bench_lat);
+	return -EBUSY;
+    }
+    kvfree(p_dev->p_bench_lat);
+    p_dev->p_bench_lat = p_bench_lat;
+    p_dev->bench_len = val;
+    p_dev->bench_done = 0;
+    p_dev->bench_errors = 0;
+    p_dev->bench_rereads = 0;
+    p_dev->bench_elapsed_ns = 0;
+    p_dev->bench_running = 1;
+    kthread_queue_work(p_dev->p_bus->p_worker, &p_dev->bench_work);
+    mutex_unlock(&p_dev->bench_lock);
+
+    return count;
+}
+static DEVICE_ATTR_WO(bench);
+
+/*
+ * "state running x/y" while a run is in progress, "state idle" before
+ * the first one, otherwise the results of the last run. Latencies are
+ * per read, including re-reads.
+ */
+static ssize_t bench_result_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    unsigned int done;
+    u64 rate;
+    u32 rate_frac;
+    u32 *lat;
+    ssize_t len;
+
+    mutex_lock(&p_dev->bench_lock);
+    if (smp_load_acquire(&p_dev->bench_running)) {
+	len = sysfs_emit(buf, "state running %u/%u\n",
+			 READ_ONCE(p_dev->bench_done), p_dev->bench_len);
+    } else if (!p_dev->p_bench_lat || !p_dev->bench_done) {
+	len = sysfs_emit(buf, "state idle\n");
+    } else {
+	done = p_dev->bench_done;
+	lat = p_dev->p_bench_lat;
+
+	/* Hundredths of a read per second */
+	rate = p_dev->bench_elapsed_ns ?
+	    div64_u64((u64)done * NSEC_PER_SEC * 100, p_dev->bench_elapsed_ns) : 0;
+	rate = div_u64_rem(rate, 100, &rate_frac);
+
+	len = sysfs_emit(buf,
+			 "state done\n"
+			 "reads %u\n"
+			 "errors %u\n"
+			 "rereads %u\n"
+			 "elapsed_us %llu\n"
+			 "reads_per_s %llu.%02u\n"
+			 "min_ns %u\n"
+			 "p50_ns %u\n"
+			 "p99_ns %u\n"
+			 "max_ns %u\n",
+			 done, p_dev->bench_errors, p_dev->bench_rereads,
+			 div_u64(p_dev->bench_elapsed_ns, NSEC_PER_USEC),
+			 rate, rate_frac, lat[0],
+			 lat[(done - 1) * 50 / 100], lat[(done - 1) * 99 / 100],
+			 lat[done - 1]);
+    }
+    mutex_unlock(&p_dev->bench_lock);
+    return len;
+}
+static DEVICE_ATTR_RO(bench_result);
+
+static struct attribute *i2c_soil_bench_attrs[] = {
+    &dev_attr_bench.attr,
+    &dev_attr_bench_result.attr,
+    NULL,
+};
+
+const struct attribute_group i2c_soil_bench_group = {
+    .attrs = i2c_soil_bench_attrs,
+};
@@ -0,0 +1,270 @@
+/**************************************************************************
+ *
+ * burst.c
+ *
+ * High-rate burst capture for the i2c soil moisture driver, for noise
+ * characterization (choosing oversampling depth and sample rate).
+ *
+ * Writing N to /sys/class/i2c-soil-drv/<dev>/burst/capture takes N raw
+ * readings, paced by absolute hrtimer deadlines and timestamped, into a
+ * dedicated buffer. Once capture reads back "done", burst/data returns
+ * the whole buffer as an array of struct i2c_soil_burst_sample.
+ * Writing 0 to capture stops a capture early, keeping what it got.
+ *
+ * The capture runs on the bus worker, so other sensors on the same bus
+ * are not sampled until it finishes. It also ends after
+ * I2C_SOIL_MAX_BURST_MS whatever N and period_us are, keeping the
+ * samples it got.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/sysfs.h>
+#include <linux/version.h>
+
+#include "i2c-soil-drv-int.h"
+
+/*
+ * Shortest burst period: the conversion delay plus the two 2-byte
+ * transfers, with margin (about 0.6 ms at 100 kHz).
+ */
+static unsigned int i2c_soil_burst_min_period_us(struct i2c_soil_dev *p_dev)
+{
+    return READ_ONCE(p_dev->conv_delay_us) + I2C_SOIL_BURST_XFER_US;
+}
+
+/*
+ * Take burst_len single (no retry) readings on absolute deadlines, so
+ * the sample spacing doesn't depend on how long each transfer took.
+ * Failed reads are recorded as -ERRNO rather than retried, since
+ * retries would disturb the spacing. Sleeps are interruptible (no
+ * hung task reports for long periods) and on burst_wq, so an abort
+ * cuts them short. The run stops at I2C_SOIL_MAX_BURST_MS.
+ */
+static void i2c_soil_burst_work(struct kthread_work *work)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(work, struct i2c_soil_dev, burst_work);
+    unsigned int conv_delay_us = READ_ONCE(p_dev->conv_delay_us);
+    unsigned int period_us = max(READ_ONCE(p_dev->burst_period_us),
+				 i2c_soil_burst_min_period_us(p_dev));
+    ktime_t expires = ktime_get();
+    ktime_t run_end = ktime_add_ms(expires, I2C_SOIL_MAX_BURST_MS);
+    DEFINE_WAIT(wait);
+
+    for (unsigned int i = 0; i < p_dev->burst_len; i++) {
+	struct i2c_soil_burst_sample *p_sample = &p_dev->p_burst_buf[i];
+
+	if (READ_ONCE(p_dev->burst_abort)) {
+	    break;
+	}
+
+	p_sample->timestamp_ns = ktime_get_ns();
+	if (p_dev->virtual_dev) {
+	    p_sample->raw = i2c_soil_vsensor_value(p_dev);
+	} else if (READ_ONCE(p_dev->use_simulation)) {
+	    p_sample->raw = READ_ONCE(p_dev->sim_data);
+	} else {
+	    p_sample->raw =
+		i2c_soil_drv_single_read_sensor(p_dev->p_i2c_client,
+						conv_delay_us);
+	}
+	WRITE_ONCE(p_dev->burst_done, i + 1);
+
+	expires = ktime_add_us(expires, period_us);
+	if (ktime_after(expires, run_end)) {
+	    break;
+	}
+	prepare_to_wait(&p_dev->burst_wq, &wait, TASK_INTERRUPTIBLE);
+	if (!READ_ONCE(p_dev->burst_abort)) {
+	    schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+	}
+	finish_wait(&p_dev->burst_wq, &wait);
+    }
+
+    /* Buffer contents are visible before the state says done */
+    smp_store_release(&p_dev->burst_running, 0);
+}
+
+void i2c_soil_burst_init(struct i2c_soil_dev *p_dev)
+{
+    mutex_init(&p_dev->burst_lock);
+    kthread_init_work(&p_dev->burst_work, i2c_soil_burst_work);
+    init_waitqueue_head(&p_dev->burst_wq);
+}
+
+/* Abort any capture in progress and free the buffer */
+void i2c_soil_burst_cleanup(struct i2c_soil_dev *p_dev)
+{
+    WRITE_ONCE(p_dev->burst_abort, 1);
+    wake_up(&p_dev->burst_wq);
+    kthread_cancel_work_sync(&p_dev->burst_work);
+    kvfree(p_dev->p_burst_buf);
+    p_dev->p_burst_buf = NULL;
+}
+
+static ssize_t period_us_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_i2c_soil_dev(dev)->burst_period_us));
+}
+
+/* 0 (the default) means the fastest safe rate; at most 1 s */
+static ssize_t period_us_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if (val > I2C_SOIL_MAX_BURST_PERIOD_US) {
+	return -EINVAL;
+    }
+    WRITE_ONCE(to_i2c_soil_dev(dev)->burst_period_us, val);
+    return count;
+}
+static DEVICE_ATTR_RW(period_us);
+
+static ssize_t capture_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+
+    if (smp_load_acquire(&p_dev->burst_running)) {
+	return sysfs_emit(buf, "running %u/%u\n",
+			  READ_ONCE(p_dev->burst_done), p_dev->burst_len);
+    } else if (p_dev->p_burst_buf) {
+	return sysfs_emit(buf, "done %u\n", READ_ONCE(p_dev->burst_done));
+    } else {
+	return sysfs_emit(buf, "idle\n");
+    }
+}
+
+/*
+ * Writing N starts an N sample capture, replacing the previous one;
+ * 0 stops the running one.
+ */
+static ssize_t capture_store(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    struct i2c_soil_burst_sample *p_burst_buf;
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if (!val) {
+	mutex_lock(&p_dev->burst_lock);
+	i2c_soil_drv_stop_run(p_dev->burst_running, &p_dev->burst_abort,
+			      &p_dev->burst_wq, &p_dev->burst_work);
+	mutex_unlock(&p_dev->burst_lock);
+	return count;
+    }
+    if (val > I2C_SOIL_MAX_BURST) {
+	return -EINVAL;
+    }
+    if ((retval = i2c_soil_probe_ready(p_dev)) < 0) {
+	return retval;		/* No bus worker yet, or ever */
+    }
+
+    p_burst_buf = kvcalloc(val, sizeof(struct i2c_soil_burst_sample),
+			   GFP_KERNEL);
+    if (!p_burst_buf) {
+	return -ENOMEM;
+    }
+
+    mutex_lock(&p_dev->burst_lock);
+    if (p_dev->burst_running) {
+	mutex_unlock(&p_dev->burst_lock);
+	kvfree(p_burst_buf);
+	return -EBUSY;
+    }
+    kvfree(p_dev->p_burst_buf);
+    p_dev->p_burst_buf = p_burst_buf;
+    p_dev->burst_len = val;
+    p_dev->burst_done = 0;
+    p_dev->burst_running = 1;
+    kthread_queue_work(p_dev->p_bus->p_worker, &p_dev->burst_work);
+    mutex_unlock(&p_dev->burst_lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(capture);
+
+/*
+ * Read out the last completed capture, -EBUSY while one is running.
+ * Since 6.13 sysfs takes const bin_attributes, through read_new and
+ * bin_attrs_new until 6.17 renamed them back.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+static ssize_t data_read(struct file *filp, struct kobject *kobj,
+			 const struct bin_attribute *attr, char *buf,
+			 loff_t off, size_t count)
+#else
+static ssize_t data_read(struct file *filp, struct kobject *kobj,
+			 struct bin_attribute *attr, char *buf,
+			 loff_t off, size_t count)
+#endif
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(kobj_to_dev(kobj));
+    size_t size;
+    ssize_t retval;
+
+    mutex_lock(&p_dev->burst_lock);
+    if (smp_load_acquire(&p_dev->burst_running)) {
+	retval = -EBUSY;
+    } else {
+	size = (size_t)p_dev->burst_done * sizeof(struct i2c_soil_burst_sample);
+	if (off >= size) {
+	    retval = 0;
+	} else {
+	    retval = min(count, (size_t)(size - off));
+	    memcpy(buf, (char *)p_dev->p_burst_buf + off, retval);
+	}
+    }
+    mutex_unlock(&p_dev->burst_lock);
+    return retval;
+}
+static BIN_ATTR_RO(data, 0);
+
+static struct attribute *i2c_soil_burst_attrs[] = {
+    &dev_attr_period_us.attr,
+    &dev_attr_capture.attr,
+    NULL,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+static const struct bin_attribute *const i2c_soil_burst_bin_attrs[] = {
+#else
+static struct bin_attribute *i2c_soil_burst_bin_attrs[] = {
+#endif
+    &bin_attr_data,
+    NULL,
+};
+
+const struct attribute_group i2c_soil_burst_group = {
+    .name = "burst",
+    .attrs = i2c_soil_burst_attrs,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+    .bin_attrs_new = i2c_soil_burst_bin_attrs,
+#else
+    .bin_attrs = i2c_soil_burst_bin_attrs,
+#endif
+};
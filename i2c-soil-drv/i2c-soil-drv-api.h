@@ -10,6 +10,9 @@
 #ifndef I2C_SOIL_DRV_API_H
 #define I2C_SOIL_DRV_API_H
 
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
 /*
  * Writing these stings to the driver turn simulation mode on or off.
  * Using in-band control instead of ioctl's to simplify testing via
@@ -17,11 +20,212 @@
  */
 #define SIM_ON_CMD	"sim-on"
 #define SIM_OFF_CMD	"sim-off"
-#define MAX_CMD_BUF_SIZE 8
+#define MAX_CMD_BUF_SIZE 8	/* Longest command, FSIM_OFF_CMD */
+
+/*
+ * Writing these switches the open file between one byte per read (the
+ * default) and a stream of struct i2c_soil_record, see below.
+ */
+#define REC_ON_CMD	"rec-on"
+#define REC_OFF_CMD	"rec-off"
+
+/*
+ * Per-file simulation: like SIM_ON_CMD, but only for the open file
+ * the command is written to. Single byte writes and byte mode reads on
+ * that file then use its own simulated value, without touching the
+ * device or other files, so independent tests can run in parallel
+ * alongside each other and the daemon.
+ */
+#define FSIM_ON_CMD	"fsim-on"
+#define FSIM_OFF_CMD	"fsim-off"
+
+/*
+ * Per-file read resolution, I2C_SOIL_RES_* below. Byte mode reads
+ * then return one native endian __u16 each instead of one byte, and
+ * record mode returns the same in the value field.
+ */
+#define RES_8_CMD	"res-8"
+#define RES_RAW_CMD	"res-raw"
+#define RES_16_CMD	"res-16"
+
+/*
+ * Record mode reader-lag coalescing for the open file: samples that
+ * drop out of the driver's buffer before this file reads them are
+ * summarized, and the next read returns one struct i2c_soil_summary
+ * covering them (see below) before carrying on with the retained
+ * samples. Without it they are skipped, and only the jump in seq shows.
+ */
+#define COAL_ON_CMD	"coal-on"
+#define COAL_OFF_CMD	"coal-off"
 
 /* On RPi, 1 is /dev/i2c-1, bus on gpio2/3 */
 #define I2C_BUS_NUM	1
 
+/* First sensor. With multiple sensors, sensor n>0 is I2C_SOIL_DEV "<n>" */
 #define I2C_SOIL_DEV	"/dev/i2c-soil-drv"
 
+/*
+ * Generic netlink multicast of samples, see netlink.c. Resolve the
+ * family by name, then join "samples" for every sample from every
+ * sensor and/or "events" for threshold crossings only.
+ */
+#define I2C_SOIL_NL_FAMILY_NAME	"i2c_soil"
+#define I2C_SOIL_NL_VERSION	1
+#define I2C_SOIL_NL_MCGRP_SAMPLES "samples"
+#define I2C_SOIL_NL_MCGRP_EVENTS "events"
+
+enum i2c_soil_nl_cmd {
+    I2C_SOIL_NL_CMD_UNSPEC,
+    I2C_SOIL_NL_CMD_SAMPLE,	/* One sample, on "samples" */
+    I2C_SOIL_NL_CMD_THRESHOLD,	/* Threshold crossing, on "events" */
+};
+
+enum i2c_soil_nl_attr {
+    I2C_SOIL_NL_A_UNSPEC,
+    I2C_SOIL_NL_A_PAD,
+    I2C_SOIL_NL_A_DEV,		/* u32: sensor number (minor) */
+    I2C_SOIL_NL_A_SEQ,		/* u32: per-sensor sample sequence number */
+    I2C_SOIL_NL_A_TIMESTAMP,	/* u64: CLOCK_MONOTONIC ns */
+    I2C_SOIL_NL_A_VALUE,	/* u8: 0=dry .. 255=wet */
+    I2C_SOIL_NL_A_RAW,		/* u16: filtered raw reading, not in sim mode */
+    I2C_SOIL_NL_A_ERROR,	/* s32: -ERRNO, instead of value, if read failed */
+    I2C_SOIL_NL_A_THRESHOLD,	/* u8: I2C_SOIL_THRESH_* now in effect */
+    __I2C_SOIL_NL_A_MAX,
+};
+#define I2C_SOIL_NL_A_MAX	(__I2C_SOIL_NL_A_MAX - 1)
+
+/* Threshold states: at/below raw_dry, between, at/above raw_wet */
+#define I2C_SOIL_THRESH_NONE	0
+#define I2C_SOIL_THRESH_DRY	1
+#define I2C_SOIL_THRESH_WET	2
+
+/*
+ * Burst capture, see burst.c. /sys/class/i2c-soil-drv/<dev>/burst/data
+ * is an array of these, one per sample.
+ */
+struct i2c_soil_burst_sample
+{
+    __s64 timestamp_ns;		/* CLOCK_MONOTONIC at start of the read */
+    __s32 raw;			/* Raw sensor reading, or -ERRNO */
+    __u32 reserved;
+};
+
+/*
+ * Record mode reads. The file offset addresses samples by sequence
+ * number: sample seq is at seq * sizeof(struct i2c_soil_record), and
+ * the driver keeps the last 256 per sensor. Each read returns the
+ * samples from the offset up to the newest, oldest first, as many as
+ * fit, so plain reads return every sample once. A jump in seq means
+ * samples were dropped because the reader fell behind; a pread() at
+ * the first missing seq fetches exactly the gap while it is still
+ * retained. Record mode files can be splice()d or sendfile()d directly
+ * to a pipe, socket or file.
+ */
+struct i2c_soil_record
+{
+    __u32 seq;			/* Per-sensor sample sequence number */
+    __s32 status;		/* 0, or -ERRNO if the read failed */
+    __s64 timestamp_ns;		/* CLOCK_MONOTONIC when the read completed */
+    __u16 value;		/* 0=dry .. 255=wet (or per I2C_SOIL_RES_*), if status is 0 */
+    __s16 raw;			/* Filtered raw reading, or -1 */
+    __u32 flags;		/* I2C_SOIL_REC_* */
+};
+
+#define I2C_SOIL_REC_SIM	0x1	/* Simulated reading */
+#define I2C_SOIL_REC_STALE	0x2	/* Last good sample, read deadline passed */
+#define I2C_SOIL_REC_SUMMARY	0x4	/* A struct i2c_soil_summary, see below */
+
+/*
+ * Summary of samples a coalescing reader fell behind on (COAL_ON_CMD).
+ * It takes the space of two records in the read buffer, so reads need
+ * room for at least that, and has flags at the same offset as a
+ * record, so the two can be told apart. Values are at the file's
+ * resolution; failed reads are only counted in errors. The file
+ * offset moves on to the first sample after it.
+ */
+struct i2c_soil_summary
+{
+    __u32 seq;			/* First sample covered */
+    __u32 count;		/* Good samples covered */
+    __s64 first_ns;		/* Timestamp of the first sample covered */
+    __u16 min;
+    __u16 max;
+    __u32 flags;		/* I2C_SOIL_REC_SUMMARY */
+    __s64 last_ns;		/* Timestamp of the last sample covered */
+    __u32 mean;			/* sum / count, rounded */
+    __u32 errors;		/* Failed reads covered */
+    __u64 sum;			/* Sum of the good values */
+};
+
+/* ioctls, equivalent to the in-band commands above */
+#define I2C_SOIL_IOC_MAGIC	0xB5
+
+/* Per-file simulation, see FSIM_ON_CMD */
+struct i2c_soil_fsim
+{
+    __u32 enable;		/* 1=on, 0=off */
+    __u32 data;			/* Simulated reading, 0-255 */
+};
+
+#define I2C_SOIL_IOC_SET_FSIM	_IOW(I2C_SOIL_IOC_MAGIC, 1, struct i2c_soil_fsim)
+#define I2C_SOIL_IOC_GET_FSIM	_IOR(I2C_SOIL_IOC_MAGIC, 2, struct i2c_soil_fsim)
+
+/*
+ * Per-file read deadline. A blocking read that can't get a fresh
+ * sample within timeout_us (say the sensor is retrying) returns the
+ * last good sample instead: in record mode one record flagged
+ * I2C_SOIL_REC_STALE, without moving the file offset; in byte mode
+ * just its value, counted in stale_reads. If there has never been a
+ * good sample the read fails with ETIMEDOUT. The fresh sample is still
+ * on its way, and a later read returns it. 0 (the default) waits as
+ * long as it takes.
+ */
+struct i2c_soil_deadline
+{
+    __u32 timeout_us;		/* 0=none */
+    __u32 stale_reads;		/* Reads answered stale, GET only */
+};
+
+#define I2C_SOIL_IOC_SET_DEADLINE _IOW(I2C_SOIL_IOC_MAGIC, 3, struct i2c_soil_deadline)
+#define I2C_SOIL_IOC_GET_DEADLINE _IOR(I2C_SOIL_IOC_MAGIC, 4, struct i2c_soil_deadline)
+
+/*
+ * Read resolutions. 8BIT clamps to the raw_dry..raw_wet calibration, so
+ * a sensor in air or held in a hand reads the same as very dry or very
+ * wet soil. RAW is the filtered 12-bit sensor reading as is, which
+ * tells those apart (about 0x141 in air, 0x3f8 when held). SCALED is
+ * the calibrated value again, but 0=dry .. 65535=wet. Simulated
+ * readings have no raw value, so are spread over raw_dry..raw_wet.
+ */
+#define I2C_SOIL_RES_8BIT	0	/* Default, see RES_8_CMD */
+#define I2C_SOIL_RES_RAW	1	/* See RES_RAW_CMD */
+#define I2C_SOIL_RES_SCALED	2	/* See RES_16_CMD */
+
+#define I2C_SOIL_IOC_SET_RES	_IOW(I2C_SOIL_IOC_MAGIC, 5, __u32)
+#define I2C_SOIL_IOC_GET_RES	_IOR(I2C_SOIL_IOC_MAGIC, 6, __u32)
+
+/*
+ * Replay of simulated samples, in sim mode. Samples are published to
+ * every reader, one at a time, at their timestamp's offset from the
+ * first sample divided by speed (1=recorded time, 10=ten times
+ * faster, 0=back to back). Timestamps must not go backwards; record
+ * mode's timestamp_ns and value can be used as is. A count of 0 stops
+ * the replay in progress; otherwise a replay in progress gets EBUSY.
+ */
+struct i2c_soil_replay_sample
+{
+    __s64 timestamp_ns;		/* Any epoch, eg CLOCK_MONOTONIC when recorded */
+    __u32 value;		/* 0=dry .. 255=wet */
+    __u32 reserved;
+};
+
+struct i2c_soil_replay
+{
+    __u64 samples;		/* Pointer to the struct i2c_soil_replay_sample array */
+    __u32 count;		/* Number of samples, 0=stop */
+    __u32 speed;		/* Speedup, 0=no delays */
+};
+
+#define I2C_SOIL_IOC_REPLAY	_IOW(I2C_SOIL_IOC_MAGIC, 7, struct i2c_soil_replay)
+
 #endif /* I2C_SOIL_DRV_API_H */
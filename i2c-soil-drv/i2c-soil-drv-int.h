@@ -14,6 +14,10 @@
 
 #include "i2c-soil-drv-api.h"
 
+/* struct i2c_soil_dev embeds a cdev and kthread works */
+#include <linux/cdev.h>
+#include <linux/kthread.h>
+
 /* From scull driver */
 #undef PDEBUG             /* undef it, just in case */
 #ifdef I2C_SOIL_DRV_DEBUG
@@ -36,6 +40,11 @@
 #define I2C_BUS_ADDR		0x36 /* Hardcoded i2c addr */
 #define I2C_TOUCH_BASE_ADDR	0x0f
 #define I2C_TOUCH_OFFSET	0x10
+#define I2C_STATUS_BASE_ADDR	0x00 /* seesaw status module */
+#define I2C_STATUS_HW_ID	0x01 /* Chip id, see I2C_HW_ID_* */
+#define I2C_HW_ID_SAMD09	0x55 /* Soil sensor's seesaw chip */
+#define I2C_HW_ID_TINY8X7_MIN	0x84 /* ATtiny8x7/16x7 based seesaw boards */
+#define I2C_HW_ID_TINY8X7_MAX	0x87
 #define I2C_MSEC_DELAY		10
 #define I2C_HIGH_OUT_OF_RANGE	4095
 #define I2C_MAX_REREADS		4
@@ -47,15 +56,370 @@
 #define I2C_MIN_DRY_READING	0
 #define I2C_MAX_WET_READING	255
 
+/*
+ * The values above are defaults. Each sensor has runtime copies,
+ * tunable in sysfs (see sysfs.c), bounded by these limits.
+ */
+#define I2C_SOIL_MAX_CONV_DELAY_US	1000000
+#define I2C_SOIL_MAX_REREADS_LIMIT	16
+#define I2C_SOIL_MAX_FILTER_DEPTH	16
+
+/*
+ * Sensor probe, see probe.c: HW_ID attempts, and the delay between
+ * them for sensors still powering up.
+ */
+#define I2C_SOIL_PROBE_TRIES	5
+#define I2C_SOIL_PROBE_RETRY_MS	200
+#define I2C_SOIL_HW_ID_DELAY_US	1000
+
+/*
+ * seesaw emulator, see i2c-soil-slave.c: readings it can cycle
+ * through, and its defaults, moist soil ready well within the
+ * driver's conversion delay.
+ */
+#define I2C_SOIL_SLAVE_MAX_READINGS	64
+#define I2C_SOIL_SLAVE_READING		0x300
+#define I2C_SOIL_SLAVE_DELAY_US		5000
+
+/* Default scan range: the soil sensor's AD0/AD1 jumper addresses */
+#define I2C_SOIL_SCAN_ADDR_MIN	0x36
+#define I2C_SOIL_SCAN_ADDR_MAX	0x39
+
+/*
+ * Benchmark runs, see bench.c: most reads, and longest run, since a
+ * run keeps every other sensor on the bus waiting.
+ */
+#define I2C_SOIL_MAX_BENCH	10000
+#define I2C_SOIL_MAX_BENCH_MS	10000
+
+/* Samples per replay, see replay.c */
+#define I2C_SOIL_MAX_REPLAY	65536
+
+/*
+ * Autonomous watering, see pump.c: defaults match soil-monitor's
+ * target and pump run time, and the longest settings allowed.
+ */
+#define I2C_SOIL_PUMP_CHIP		"pinctrl-bcm2711" /* RPi 4 header gpios */
+#define I2C_SOIL_PUMP_TARGET		0x80
+#define I2C_SOIL_PUMP_MAX_ON_MS		5000
+#define I2C_SOIL_PUMP_REST_MS		60000
+#define I2C_SOIL_MAX_PUMP_ON_MS		600000
+#define I2C_SOIL_MAX_PUMP_REST_MS	86400000
+
+/*
+ * Burst capture limits, see burst.c: the run is capped in time as
+ * well, since it keeps every other sensor on the bus waiting.
+ */
+#define I2C_SOIL_MAX_BURST	65536
+#define I2C_SOIL_MAX_BURST_MS	120000
+#define I2C_SOIL_MAX_BURST_PERIOD_US 1000000
+#define I2C_SOIL_BURST_XFER_US	1000
+
+/*
+ * Up to I2C_SOIL_MAX_DEVS sensors, configured by the i2c_buses and
+ * i2c_addrs module parameters. Sensor 0 keeps the historical node name
+ * (I2C_SOIL_DEV); the rest are I2C_SOIL_DEV<n>.
+ */
+#define I2C_SOIL_MAX_DEVS	16
+
+/*
+ * Virtual sensors, created through configfs (see vsensor.c), take the
+ * minors after the real ones.
+ */
+#define I2C_SOIL_MAX_VDEVS	1024
+#define I2C_SOIL_MAX_MINORS	(I2C_SOIL_MAX_DEVS + I2C_SOIL_MAX_VDEVS)
+
+/*
+ * Samples retained per sensor for record mode readers (power of 2),
+ * and how many are copied out per sample_lock hold.
+ */
+#define I2C_SOIL_RING_LEN	256
+#define I2C_SOIL_READ_BATCH	16
+
+/*
+ * Prefetches start this much earlier than the expected read, on top of
+ * the acquisition time, to cover worker wakeup and jiffy rounding.
+ */
+#define I2C_SOIL_PREFETCH_SLACK_NS (5 * NSEC_PER_MSEC)
+
+/*
+ * Periodic sample time jitter histogram, see sched.c: bucket 0 is
+ * under 1us, bucket n under 2^n us, and the last one everything over.
+ */
+#define I2C_SOIL_JITTER_BUCKETS	21
+
+/*
+ * One per i2c adapter in use. Every transaction for sensors on the bus
+ * runs on the bus's kthread worker, so sensors sharing a bus are
+ * serialized while sensors on different buses sample in parallel.
+ */
+struct i2c_soil_bus
+{
+    int bus_num;		/* i2c adapter number, ie, /dev/i2c-N */
+    int bus_index;		/* Position in the bus table */
+    int num_devs;		/* Sensors on this bus */
+    struct i2c_adapter *p_i2c_adapter;
+    struct kthread_worker *p_worker;
+    spinlock_t stats_lock;	/* Protects the utilization counters */
+    u64 busy_ns;		/* Time spent in transactions */
+    u64 num_samples;		/* Transactions completed */
+    ktime_t stats_start;	/* Start of the utilization window */
+};
+
+/* One acquisition, as published to readers and over netlink */
+struct i2c_soil_sample
+{
+    u32 seq;			/* Value of sample_seq after this sample */
+    ktime_t timestamp;		/* When the reading completed */
+    ssize_t val;		/* Normalized reading, or -ERRNO */
+    int raw;			/* Filtered raw reading, -1 if simulated */
+};
+
 struct i2c_soil_dev
 {
     /* cdev @ start - single inheritance, p_cdev = p_aesd_dev */
     /* Don't really need to use container_of */
     struct cdev cdev;		/* Char device structure */
-    struct i2c_adapter *p_i2c_adapter;
+    struct device dev;		/* Owns the allocation, see release */
+    int index;			/* Minor number and sensor number */
+    int bus_num;		/* Configured i2c adapter */
+    int addr;			/* Configured i2c address */
+    int probe_state;		/* I2C_SOIL_PROBE_* */
+    int probe_tries;		/* HW_ID attempts so far */
+    int hw_id;			/* seesaw HW_ID, once probed */
+    struct kthread_delayed_work probe_work; /* Sensor verification */
+    /* p_bus and p_i2c_client are only valid once probe_state is READY */
+    int bus_slot;		/* Position among the sensors on p_bus */
+    struct i2c_soil_bus *p_bus;
     struct i2c_client *p_i2c_client; /* dummy client */
     int use_simulation;	       /* 1=simulation (no i2c), 0=i2c mode */
     unsigned char sim_data; /* When sim on, write updates this, read returns this */
+    struct mutex config_lock;	/* Serializes sysfs reconfiguration */
+    unsigned int conv_delay_us;	/* Register write to data read delay */
+    unsigned int max_rereads;	/* Retries for out-of-range readings */
+    unsigned int filter_depth;	/* Moving average length, 1=unfiltered */
+    int raw_dry;		/* Raw reading at or below which value is dry */
+    int raw_wet;		/* Raw reading at or above which value is wet */
+    spinlock_t sample_lock;	/* Protects sample(_seq), filter, file state */
+    int filter_buf[I2C_SOIL_MAX_FILTER_DEPTH]; /* Last raw readings */
+    unsigned int filter_len;	/* Valid entries in filter_buf */
+    unsigned int filter_pos;	/* Next filter_buf entry to replace */
+    int filter_sum;		/* Sum of the valid filter_buf entries */
+    wait_queue_head_t sample_wq; /* Readers and pollers waiting for a sample */
+    struct kthread_work sample_work; /* On-demand acquisition */
+    struct kthread_delayed_work sched_work; /* Periodic acquisition */
+    unsigned int sample_period_ms; /* 0=on-demand only */
+    ktime_t next_deadline;	/* Next periodic sample, absolute */
+    struct hrtimer sched_timer;	/* Periodic pacing in rt_sched mode */
+    struct kthread_work sched_rt_work; /* Periodic acquisition, rt_sched mode */
+    atomic64_t rt_deadline;	/* Deadline sched_timer last queued for */
+    u32 jitter_hist[I2C_SOIL_JITTER_BUCKETS]; /* Under sample_lock */
+    u64 jitter_count;		/* Periodic samples measured */
+    u64 jitter_sum_ns;
+    u64 jitter_max_ns;
+    u32 sample_seq;		/* Number of completed acquisitions */
+    /* Last I2C_SOIL_RING_LEN samples, sample seq at ring[seq % RING_LEN] */
+    struct i2c_soil_sample ring[I2C_SOIL_RING_LEN];
+    struct i2c_soil_sample last_good; /* Newest sample with val >= 0, seq 0=none */
+    int thresh_state;		/* I2C_SOIL_THRESH_* of the latest good sample */
+    struct list_head coalesce_list; /* Coalescing files, under sample_lock */
+    struct mutex burst_lock;	/* Protects burst buffer replacement/readout */
+    struct kthread_work burst_work; /* Runs a capture on the bus worker */
+    wait_queue_head_t burst_wq;	/* Capture waits here between samples */
+    struct i2c_soil_burst_sample *p_burst_buf;
+    unsigned int burst_len;	/* Samples requested */
+    unsigned int burst_done;	/* Samples captured so far */
+    unsigned int burst_period_us; /* 0=fastest safe rate */
+    int burst_running;		/* 1=capture in progress */
+    int burst_abort;		/* 1=stop capturing (user, or device going away) */
+    struct mutex bench_lock;	/* Protects bench buffer replacement/readout */
+    struct kthread_work bench_work; /* Runs a benchmark on the bus worker */
+    u32 *p_bench_lat;		/* Per-read latency, ns */
+    unsigned int bench_len;	/* Reads requested */
+    unsigned int bench_done;	/* Reads completed so far */
+    unsigned int bench_errors;	/* Reads that failed */
+    unsigned int bench_rereads;	/* Re-reads of out-of-range values */
+    u64 bench_elapsed_ns;	/* Wall time of the whole run */
+    int bench_running;		/* 1=benchmark in progress */
+    int bench_abort;		/* 1=stop reading (user, or device going away) */
+    struct mutex replay_lock;	/* Protects replay buffer replacement */
+    struct work_struct replay_work; /* Runs a replay, see replay.c */
+    wait_queue_head_t replay_wq; /* Replay waits here between samples */
+    struct i2c_soil_replay_sample *p_replay_buf;
+    unsigned int replay_len;	/* Samples to replay */
+    unsigned int replay_done;	/* Samples replayed so far */
+    unsigned int replay_speed;	/* Speedup, 0=no delays */
+    int replay_running;		/* 1=replay in progress */
+    int replay_abort;		/* 1=stop replaying */
+    struct gpio_desc *p_pump;	/* Pump line, see pump.c, NULL=no pump */
+    struct gpiod_lookup_table *p_pump_lookup;
+    spinlock_t pump_lock;	/* Protects the pump state, also taken in softirq */
+    struct hrtimer pump_timer;	/* Enforces pump_max_on_ms */
+    unsigned int pump_enable;	/* 1=water autonomously */
+    unsigned int pump_target;	/* Start below this value, stop at it, 0-255 */
+    unsigned int pump_max_on_ms; /* Safety limit on one run */
+    unsigned int pump_rest_ms;	/* Least time off between runs */
+    int pump_on;		/* 1=pump running */
+    ktime_t pump_start;		/* When the current run started */
+    ktime_t pump_deadline;	/* When the current run must stop */
+    ktime_t pump_stop;		/* When the last run stopped */
+    u32 pump_runs;		/* Runs started */
+    u32 pump_safety_stops;	/* Runs stopped by pump_max_on_ms */
+    u64 pump_on_ns;		/* Total time on, finished runs */
+    u64 pump_latency_ns;	/* Sample to pump on, last run */
+    struct kthread_delayed_work prefetch_work; /* Speculative acquisition */
+    unsigned int prefetch;	/* 1=learn on-demand read cadence, prefetch */
+    ktime_t last_read;		/* Last on-demand read request */
+    u64 read_interval_ns;	/* Smoothed interval between on-demand reads */
+    u64 acq_ns;			/* Smoothed i2c acquisition time */
+    u32 prefetch_seq;		/* Prefetched sample not yet returned, 0=none */
+    int prefetch_busy;		/* 1=prefetch acquisition running */
+    int virtual_dev;		/* 1=configfs virtual sensor, never uses i2c */
+    int removed;		/* 1=destroyed, open files get -ENODEV */
+    unsigned int wave;		/* I2C_SOIL_WAVE_*, virtual sensors only */
+    unsigned int wave_min;	/* Waveform low value, 0-255 */
+    unsigned int wave_max;	/* Waveform high value, 0-255 */
+    unsigned int wave_period_ms; /* Waveform period */
 };
 
+/* Sensor probe states */
+#define I2C_SOIL_PROBE_PENDING	0	/* Not yet verified, reads wait */
+#define I2C_SOIL_PROBE_READY	1	/* Verified (or virtual) */
+#define I2C_SOIL_PROBE_ABSENT	2	/* Not found, reads fail -ENODEV */
+
+/* Virtual sensor waveforms */
+#define I2C_SOIL_WAVE_CONST	0	/* Always wave_min */
+#define I2C_SOIL_WAVE_SINE	1
+#define I2C_SOIL_WAVE_SQUARE	2
+#define I2C_SOIL_WAVE_TRIANGLE	3
+#define I2C_SOIL_WAVE_SAWTOOTH	4
+#define I2C_SOIL_WAVE_NOISE	5	/* Uniform in [wave_min, wave_max] */
+
+#define to_i2c_soil_dev(d) container_of(d, struct i2c_soil_dev, dev)
+
+/* Exponentially weighted moving average, weight 1/8; avg 0 means none yet */
+static inline u64 i2c_soil_ewma(u64 avg, u64 val)
+{
+    return avg ? (avg - (avg >> 3) + (val >> 3)) : val;
+}
+
+/*
+ * Per-open-file state, stored in filp->private_data. A read waits for
+ * the device's sample_seq to reach want_seq, so non-blocking readers
+ * and poll can tell when their sample has arrived. In on-demand mode
+ * that is a fresh acquisition; with periodic sampling it is the first
+ * sample this file hasn't returned yet (seen_seq + 1).
+ */
+struct i2c_soil_file
+{
+    struct i2c_soil_dev *p_dev;
+    u32 want_seq;		/* sample_seq that satisfies the pending read */
+    u32 seen_seq;		/* sample_seq last returned by this file */
+    int req_pending;		/* 1=sample requested, not yet returned */
+    int probe_wait;		/* 1=non-blocking read got -EAGAIN while probing */
+    int format;			/* I2C_SOIL_FMT_* */
+    int use_simulation;		/* 1=byte reads return sim_data, below */
+    unsigned char sim_data;	/* Per-file simulated reading */
+    u32 deadline_us;		/* Blocking read deadline, 0=none */
+    u32 stale_reads;		/* Reads answered with last_good */
+    int res;			/* I2C_SOIL_RES_* */
+    struct list_head coalesce_node; /* On p_dev->coalesce_list, see COAL_ON_CMD */
+    u32 next_seq;		/* Record mode: seq the next read starts at */
+    u32 agg_next;		/* Seq after the last one summarized */
+    struct i2c_soil_summary agg; /* Samples evicted unread, count+errors 0=none */
+};
+
+/* Per-file read formats, selected by REC_ON_CMD/REC_OFF_CMD */
+#define I2C_SOIL_FMT_BYTE	0	/* One u8 per read (default) */
+#define I2C_SOIL_FMT_REC	1	/* struct i2c_soil_record stream */
+
+/* main.c */
+ssize_t i2c_soil_drv_single_read_sensor(struct i2c_client *p_i2c_client,
+					unsigned int conv_delay_us);
+ssize_t i2c_soil_drv_read_sensor(struct i2c_soil_dev *p_dev,
+				 unsigned int *p_rereads);
+void i2c_soil_drv_set_sim(struct i2c_soil_dev *p_dev, int on);
+void i2c_soil_drv_stop_run(int running, int *p_abort, wait_queue_head_t *p_wq,
+			   struct kthread_work *p_work);
+void i2c_soil_drv_acquire(struct i2c_soil_dev *p_dev);
+void i2c_soil_drv_inject(struct i2c_soil_dev *p_dev, u8 val);
+struct i2c_soil_dev *i2c_soil_drv_alloc_dev(int index);
+int i2c_soil_drv_add_dev(struct i2c_soil_dev *p_dev);
+void i2c_soil_drv_destroy_dev(struct i2c_soil_dev *p_dev);
+bool i2c_soil_drv_configured(int bus_num, int addr);
+int i2c_soil_drv_add_sensor(int bus_num, int addr);
+extern int i2c_soil_scan_addr_min;
+extern int i2c_soil_scan_addr_max;
+extern bool i2c_soil_rt_sched;
+extern int i2c_soil_rt_cpu;
+
+/* sched.c */
+struct i2c_soil_bus *i2c_soil_bus_get(int bus_num);
+int i2c_soil_bus_add_dev(struct i2c_soil_bus *p_bus);
+void i2c_soil_bus_put_all(void);
+void i2c_soil_sched_init(struct i2c_soil_dev *p_dev);
+void i2c_soil_sched_request(struct i2c_soil_dev *p_dev);
+void i2c_soil_sched_start(struct i2c_soil_dev *p_dev);
+void i2c_soil_sched_stop(struct i2c_soil_dev *p_dev);
+void i2c_soil_sched_set_period(struct i2c_soil_dev *p_dev,
+			       unsigned int period_ms);
+void i2c_soil_sched_account(struct i2c_soil_bus *p_bus, ktime_t start);
+void i2c_soil_sched_jitter_reset(struct i2c_soil_dev *p_dev);
+u32 i2c_soil_prefetch_want(struct i2c_soil_dev *p_dev, ktime_t now, int *kick);
+void i2c_soil_debugfs_init(void);
+void i2c_soil_debugfs_cleanup(void);
+
+/* sysfs.c */
+extern const struct attribute_group *i2c_soil_dev_groups[];
+
+/* netlink.c */
+int i2c_soil_nl_init(void);
+void i2c_soil_nl_cleanup(void);
+void i2c_soil_nl_sample(struct i2c_soil_dev *p_dev,
+			const struct i2c_soil_sample *p_sample);
+void i2c_soil_nl_threshold(struct i2c_soil_dev *p_dev,
+			   const struct i2c_soil_sample *p_sample,
+			   int thresh_state);
+
+/* burst.c */
+extern const struct attribute_group i2c_soil_burst_group;
+void i2c_soil_burst_init(struct i2c_soil_dev *p_dev);
+void i2c_soil_burst_cleanup(struct i2c_soil_dev *p_dev);
+
+/* probe.c */
+void i2c_soil_probe_init(struct i2c_soil_dev *p_dev);
+void i2c_soil_probe_start(struct i2c_soil_dev *p_dev);
+void i2c_soil_probe_stop(struct i2c_soil_dev *p_dev);
+void i2c_soil_probe_sync(void);
+int i2c_soil_probe_ready(struct i2c_soil_dev *p_dev);
+int i2c_soil_probe_hw_id(struct i2c_adapter *p_adapter, u16 addr);
+bool i2c_soil_probe_hw_id_ok(int hw_id);
+void i2c_soil_probe_scan(int bus_num);
+
+/* bench.c */
+extern const struct attribute_group i2c_soil_bench_group;
+void i2c_soil_bench_init(struct i2c_soil_dev *p_dev);
+void i2c_soil_bench_cleanup(struct i2c_soil_dev *p_dev);
+
+/* replay.c */
+extern const struct attribute_group i2c_soil_replay_group;
+void i2c_soil_replay_init(struct i2c_soil_dev *p_dev);
+void i2c_soil_replay_cleanup(struct i2c_soil_dev *p_dev);
+int i2c_soil_replay_start(struct i2c_soil_dev *p_dev,
+			  const struct i2c_soil_replay *p_replay);
+
+/* pump.c */
+extern const struct attribute_group i2c_soil_pump_group;
+void i2c_soil_pump_init(struct i2c_soil_dev *p_dev);
+int i2c_soil_pump_attach(struct i2c_soil_dev *p_dev, const char *chip_label,
+			 unsigned int offset);
+void i2c_soil_pump_detach(struct i2c_soil_dev *p_dev);
+void i2c_soil_pump_sample(struct i2c_soil_dev *p_dev,
+			  const struct i2c_soil_sample *p_sample);
+
+/* vsensor.c */
+int i2c_soil_vsensor_init(void);
+void i2c_soil_vsensor_cleanup(void);
+int i2c_soil_vsensor_value(struct i2c_soil_dev *p_dev);
+
 #endif /* I2C_SOIL_DRV_INT_H */
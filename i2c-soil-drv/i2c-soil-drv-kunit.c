@@ -0,0 +1,316 @@
+/**************************************************************************
+ *
+ * i2c-soil-drv-kunit.c
+ *
+ * KUnit tests for the i2c soil moisture driver's read path: boundary
+ * readings, the I2C_READING_OUT_OF_BOUNDS re-read loop, i2c errors,
+ * normalization and record mode file offsets. Readings come from a
+ * fake adapter, so the tests need no sensor and the real
+ * i2c_master_send/i2c_master_recv path is used. Each read is timed;
+ * the tests check it took at least its conversion delays and not much
+ * more, and report the time with kunit_info, so changes to delays or
+ * the read loop show up as a latency change too.
+ *
+ * Included at the end of main.c (so the static helpers are in reach)
+ * when built with KUNIT=y. The suite runs when the module is loaded,
+ * eg under UML: build a UML kernel with CONFIG_KUNIT, CONFIG_I2C and
+ * CONFIG_MODULES, then
+ *
+ *   make KERNELDIR=<uml build dir> ARCH=um KUNIT=y
+ *
+ * and insmod i2c-soil-drv.ko in it; results are in the kernel log in
+ * KTAP format. Loaded without module parameters, the driver itself
+ * creates no sensors, so the tests run alone.
+ */
+
+#include <kunit/test.h>
+
+/* Conversion delay for tests: short, but long enough to time */
+#define I2C_SOIL_KUNIT_DELAY_US	200
+/* Allowed time over the conversion delays, for scheduling and i2c */
+#define I2C_SOIL_KUNIT_SLACK_NS	(50 * NSEC_PER_MSEC)
+#define I2C_SOIL_KUNIT_MAX_REPLIES 16
+
+/*
+ * Fake adapter: each 2 byte read returns the next scripted reply (the
+ * last one repeats), and transfer number fail_xfer, if any, fails.
+ */
+struct i2c_soil_kunit_bus
+{
+    struct i2c_adapter adapter;
+    struct i2c_client *p_client;
+    u16 replies[I2C_SOIL_KUNIT_MAX_REPLIES];
+    int num_replies;
+    int next_reply;
+    int xfers;			/* Transfers seen */
+    int fail_xfer;		/* 1-based transfer to fail, 0=none */
+    int bad_writes;		/* Writes that weren't the moisture register */
+};
+
+static int i2c_soil_kunit_xfer(struct i2c_adapter *adapter,
+			       struct i2c_msg *msgs, int num)
+{
+    struct i2c_soil_kunit_bus *p_bus =
+	container_of(adapter, struct i2c_soil_kunit_bus, adapter);
+    u16 reply;
+
+    for (int i = 0; i < num; i++) {
+	if (++p_bus->xfers == p_bus->fail_xfer) {
+	    return -ENXIO;
+	}
+	if (!(msgs[i].flags & I2C_M_RD)) {
+	    if ((msgs[i].len != 2) ||
+		(msgs[i].buf[0] != I2C_TOUCH_BASE_ADDR) ||
+		(msgs[i].buf[1] != I2C_TOUCH_OFFSET)) {
+		p_bus->bad_writes++;
+	    }
+	    continue;
+	}
+	reply = p_bus->replies[p_bus->next_reply];
+	if (p_bus->next_reply < p_bus->num_replies - 1) {
+	    p_bus->next_reply++;
+	}
+	msgs[i].buf[0] = reply >> 8;
+	if (msgs[i].len > 1) {
+	    msgs[i].buf[1] = reply & 0xff;
+	}
+    }
+    return num;
+}
+
+static u32 i2c_soil_kunit_func(struct i2c_adapter *adapter)
+{
+    return I2C_FUNC_I2C;
+}
+
+static const struct i2c_algorithm i2c_soil_kunit_algo = {
+    .master_xfer = i2c_soil_kunit_xfer,
+    .functionality = i2c_soil_kunit_func,
+};
+
+/* Per-test device, wired to a fresh fake adapter */
+struct i2c_soil_kunit_ctx
+{
+    struct i2c_soil_kunit_bus bus;
+    struct i2c_soil_dev dev;
+};
+
+/*
+ * test->priv is only set once the adapter and client are both up: exit
+ * runs even when init fails, and must not remove what was never added.
+ */
+static int i2c_soil_kunit_init(struct kunit *test)
+{
+    struct i2c_soil_kunit_ctx *p_ctx;
+    struct i2c_client *p_client;
+
+    test->priv = NULL;
+    p_ctx = kunit_kzalloc(test, sizeof(*p_ctx), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, p_ctx);
+
+    p_ctx->bus.adapter.owner = THIS_MODULE;
+    p_ctx->bus.adapter.algo = &i2c_soil_kunit_algo;
+    strscpy(p_ctx->bus.adapter.name, "i2c-soil-kunit",
+	    sizeof(p_ctx->bus.adapter.name));
+    KUNIT_ASSERT_EQ(test, i2c_add_adapter(&p_ctx->bus.adapter), 0);
+
+    p_client = i2c_new_dummy_device(&p_ctx->bus.adapter, I2C_BUS_ADDR);
+    if (IS_ERR(p_client)) {
+	i2c_del_adapter(&p_ctx->bus.adapter);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, p_client);
+    }
+    p_ctx->bus.p_client = p_client;
+
+    p_ctx->dev.p_i2c_client = p_client;
+    p_ctx->dev.conv_delay_us = I2C_SOIL_KUNIT_DELAY_US;
+    p_ctx->dev.max_rereads = I2C_MAX_REREADS;
+    p_ctx->dev.raw_dry = I2C_MIN_RAW_DRY_READING;
+    p_ctx->dev.raw_wet = I2C_MAX_RAW_WET_READING;
+    test->priv = p_ctx;
+    return 0;
+}
+
+static void i2c_soil_kunit_exit(struct kunit *test)
+{
+    struct i2c_soil_kunit_ctx *p_ctx = test->priv;
+
+    if (!p_ctx) {
+	return;			/* Init failed, and cleaned up */
+    }
+    i2c_unregister_device(p_ctx->bus.p_client);
+    i2c_del_adapter(&p_ctx->bus.adapter);
+}
+
+static void i2c_soil_kunit_script(struct i2c_soil_kunit_ctx *p_ctx,
+				  const u16 *replies, int num_replies)
+{
+    memcpy(p_ctx->bus.replies, replies, num_replies * sizeof(u16));
+    p_ctx->bus.num_replies = num_replies;
+    p_ctx->bus.next_reply = 0;
+    p_ctx->bus.xfers = 0;
+}
+
+/*
+ * Read the sensor, checking the result, the re-read count and that it
+ * took the conversion delays it should: one per read, plus one before
+ * each re-read. Returns the time taken.
+ */
+static u64 i2c_soil_kunit_read(struct kunit *test, ssize_t expected,
+			       unsigned int expected_rereads)
+{
+    struct i2c_soil_kunit_ctx *p_ctx = test->priv;
+    u64 min_ns = (1 + 2 * expected_rereads) *
+	(u64)I2C_SOIL_KUNIT_DELAY_US * NSEC_PER_USEC;
+    unsigned int rereads = ~0;
+    ktime_t start;
+    ssize_t reading;
+    u64 ns;
+
+    start = ktime_get();
+    reading = i2c_soil_drv_read_sensor(&p_ctx->dev, &rereads);
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    KUNIT_EXPECT_EQ(test, reading, expected);
+    KUNIT_EXPECT_EQ(test, rereads, expected_rereads);
+    KUNIT_EXPECT_EQ(test, p_ctx->bus.bad_writes, 0);
+    KUNIT_EXPECT_GE(test, ns, min_ns);
+    KUNIT_EXPECT_LT(test, ns, min_ns + I2C_SOIL_KUNIT_SLACK_NS);
+    kunit_info(test, "reading %zd, %u re-reads: %llu ns\n",
+	       reading, rereads, ns);
+    return ns;
+}
+
+/* In-bounds readings come back as is, first time */
+static void i2c_soil_kunit_bounds(struct kunit *test)
+{
+    static const u16 readings[] = {
+	0x000,
+	0x141,			/* Free air */
+	I2C_MIN_RAW_DRY_READING,
+	I2C_MAX_RAW_WET_READING,
+	0x380,			/* Low byte >= 0x80 must not sign extend */
+	0x3f8,			/* Held between fingers */
+	I2C_HIGH_OUT_OF_RANGE,
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(readings); i++) {
+	i2c_soil_kunit_script(test->priv, &readings[i], 1);
+	i2c_soil_kunit_read(test, readings[i], 0);
+    }
+}
+
+/* Out of bounds readings are re-read until one is in bounds */
+static void i2c_soil_kunit_reread(struct kunit *test)
+{
+    static const u16 replies[] = {
+	I2C_HIGH_OUT_OF_RANGE + 1, 0xffff, 0x300,
+    };
+    struct i2c_soil_kunit_ctx *p_ctx = test->priv;
+
+    i2c_soil_kunit_script(p_ctx, replies, ARRAY_SIZE(replies));
+    i2c_soil_kunit_read(test, 0x300, 2);
+    KUNIT_EXPECT_EQ(test, p_ctx->bus.xfers, 2 * 3);
+}
+
+/* ... but only max_rereads times */
+static void i2c_soil_kunit_reread_limit(struct kunit *test)
+{
+    static const u16 replies[] = { 0xffff };
+    struct i2c_soil_kunit_ctx *p_ctx = test->priv;
+
+    i2c_soil_kunit_script(p_ctx, replies, ARRAY_SIZE(replies));
+    i2c_soil_kunit_read(test, -EIO, I2C_MAX_REREADS);
+    KUNIT_EXPECT_EQ(test, p_ctx->bus.xfers, 2 * (1 + I2C_MAX_REREADS));
+
+    p_ctx->dev.max_rereads = 0;
+    i2c_soil_kunit_script(p_ctx, replies, ARRAY_SIZE(replies));
+    i2c_soil_kunit_read(test, -EIO, 0);
+    KUNIT_EXPECT_EQ(test, p_ctx->bus.xfers, 2);
+}
+
+/*
+ * A failed transfer is re-read like a bad reading. A failed register
+ * write returns before the conversion delay, so check that separately.
+ */
+static void i2c_soil_kunit_xfer_error(struct kunit *test)
+{
+    static const u16 replies[] = { 0x2c0 };
+    struct i2c_soil_kunit_ctx *p_ctx = test->priv;
+
+    i2c_soil_kunit_script(p_ctx, replies, ARRAY_SIZE(replies));
+    p_ctx->bus.fail_xfer = 2;	/* First read */
+    i2c_soil_kunit_read(test, 0x2c0, 1);
+
+    i2c_soil_kunit_script(p_ctx, replies, ARRAY_SIZE(replies));
+    p_ctx->bus.fail_xfer = 1;	/* First register write */
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_read_sensor(&p_ctx->dev, NULL), 0x2c0);
+    KUNIT_EXPECT_EQ(test, p_ctx->bus.xfers, 1 + 2);
+}
+
+static void i2c_soil_kunit_normalize(struct kunit *test)
+{
+    struct i2c_soil_kunit_ctx *p_ctx = test->priv;
+    struct i2c_soil_dev *p_dev = &p_ctx->dev;
+    int mid = (p_dev->raw_dry + p_dev->raw_wet) / 2;
+
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_normalize(p_dev, 0x141), I2C_MIN_DRY_READING);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_normalize(p_dev, p_dev->raw_dry - 1),
+		    I2C_MIN_DRY_READING);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_normalize(p_dev, p_dev->raw_dry),
+		    I2C_MIN_DRY_READING);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_normalize(p_dev, p_dev->raw_wet),
+		    I2C_MAX_WET_READING);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_normalize(p_dev, p_dev->raw_wet + 1),
+		    I2C_MAX_WET_READING);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_normalize(p_dev, 0x3f8), I2C_MAX_WET_READING);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_normalize(p_dev, mid),
+		    (mid - p_dev->raw_dry) * I2C_MAX_WET_READING /
+		    (p_dev->raw_wet - p_dev->raw_dry));
+
+    /* Monotonic across the calibrated range */
+    for (int raw = p_dev->raw_dry; raw < p_dev->raw_wet; raw++) {
+	KUNIT_ASSERT_LE(test, i2c_soil_drv_normalize(p_dev, raw),
+			i2c_soil_drv_normalize(p_dev, raw + 1));
+    }
+
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_thresh_state(I2C_MIN_DRY_READING),
+		    I2C_SOIL_THRESH_DRY);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_thresh_state(I2C_MIN_DRY_READING + 1),
+		    I2C_SOIL_THRESH_NONE);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_thresh_state(I2C_MAX_WET_READING),
+		    I2C_SOIL_THRESH_WET);
+}
+
+/* Record mode file offsets: whole records, up to the last sequence number */
+static void i2c_soil_kunit_pos_to_seq(struct kunit *test)
+{
+    const loff_t rec = sizeof(struct i2c_soil_record);
+
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq(0), 1);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq(rec), 1);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq(5 * rec), 5);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq(5 * rec + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq(rec - 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq(U32_MAX * rec), U32_MAX);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq((U32_MAX + 1LL) * rec), -EINVAL);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq(-rec), -EINVAL);
+    KUNIT_EXPECT_EQ(test, i2c_soil_drv_pos_to_seq(-1), -EINVAL);
+}
+
+static struct kunit_case i2c_soil_kunit_cases[] = {
+    KUNIT_CASE(i2c_soil_kunit_bounds),
+    KUNIT_CASE(i2c_soil_kunit_reread),
+    KUNIT_CASE(i2c_soil_kunit_reread_limit),
+    KUNIT_CASE(i2c_soil_kunit_xfer_error),
+    KUNIT_CASE(i2c_soil_kunit_normalize),
+    KUNIT_CASE(i2c_soil_kunit_pos_to_seq),
+    {}
+};
+
+static struct kunit_suite i2c_soil_kunit_suite = {
+    .name = "i2c-soil-drv",
+    .init = i2c_soil_kunit_init,
+    .exit = i2c_soil_kunit_exit,
+    .test_cases = i2c_soil_kunit_cases,
+};
+kunit_test_suite(i2c_soil_kunit_suite);
@@ -0,0 +1,404 @@
+/**************************************************************************
+ *
+ * i2c-soil-drv-stress.c
+ *
+ * Concurrency stress and scalability benchmark for the i2c soil
+ * moisture driver. Companion to i2c-soil-drv-test.sh, which checks
+ * values one at a time; this one checks that the driver holds up, and
+ * scales, with many readers and writers at once.
+ *
+ * Forks -p processes, each running a number of threads, and every
+ * thread opens the device on its own and runs -n operations drawn at
+ * random from a mix (-m) of:
+ *
+ *   read   1 byte byte mode read
+ *   write  1 byte sim data write (the device's sim_data in sim mode)
+ *   mode   file sim mode switch, fsim-on/fsim-off; with -S device sim
+ *          mode switch, sim-on/sim-off, which sends reads to the sensor
+ *
+ * The thread count per process doubles from 1 up to -t, and for each
+ * count it reports throughput and per-operation latency percentiles.
+ * The device is put in sim mode first, so by default the sensor is
+ * never touched, and back out of it at the end.
+ *
+ * Build with "make stress" in this directory.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "i2c-soil-drv-api.h"
+
+/* Defaults for options */
+#define DEFAULT_PROCS		1
+#define DEFAULT_MAX_THREADS	8
+#define DEFAULT_OPS		2000
+
+/* Operation types */
+#define OP_READ		0
+#define OP_WRITE	1
+#define OP_MODE		2
+#define NUM_OPS		3
+
+static const char *op_names[NUM_OPS] = { "read", "write", "mode" };
+
+/* One operation's result, in the mapping shared with the children */
+struct op_result
+{
+    uint32_t ns;		/* Latency */
+    uint8_t op;			/* OP_* */
+    uint8_t err;		/* 1=failed */
+};
+
+/* Each thread's run, also in the shared mapping */
+struct thread_result
+{
+    struct timespec start;
+    struct timespec end;
+};
+
+struct stress_opts
+{
+    const char *dev;
+    int procs;
+    int max_threads;
+    int ops;
+    int mix[NUM_OPS];		/* Relative weights */
+    int dev_sim;		/* 1=mode switches are device wide */
+};
+
+/* What a thread needs to run */
+struct thread_args
+{
+    const struct stress_opts *p_opts;
+    int start_fd;		/* Read end of the start pipe */
+    unsigned int seed;
+    struct op_result *p_ops;	/* p_opts->ops entries */
+    struct thread_result *p_result;
+};
+
+void print_usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-d dev] [-p procs] [-t max_threads] [-n ops] [-m r:w:m] [-S]\n",
+	    argv0);
+    fprintf(stderr, "   -d <dev> : Device to test (default is %s).\n", I2C_SOIL_DEV);
+    fprintf(stderr, "   -p <procs> : Processes (default is %d).\n", DEFAULT_PROCS);
+    fprintf(stderr, "   -t <max_threads> : Most threads per process; runs 1, 2, 4...\n");
+    fprintf(stderr, "        up to this (default is %d).\n", DEFAULT_MAX_THREADS);
+    fprintf(stderr, "   -n <ops> : Operations per thread (default is %d).\n", DEFAULT_OPS);
+    fprintf(stderr, "   -m <r:w:m> : Read:write:mode switch mix (default is 8:1:1).\n");
+    fprintf(stderr, "   -S : Mode switches are device sim-on/sim-off, reads then\n");
+    fprintf(stderr, "        also go to the sensor (default is per-file fsim).\n");
+}
+
+void parse_options(int argc, char *argv[], struct stress_opts *p_opts)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:p:t:n:m:S?")) != -1) {
+	switch (opt) {
+	case 'd':
+	    p_opts->dev = optarg;
+	    break;
+	case 'p':
+	    p_opts->procs = atoi(optarg);
+	    break;
+	case 't':
+	    p_opts->max_threads = atoi(optarg);
+	    break;
+	case 'n':
+	    p_opts->ops = atoi(optarg);
+	    break;
+	case 'm':
+	    if (sscanf(optarg, "%d:%d:%d", &p_opts->mix[OP_READ],
+		       &p_opts->mix[OP_WRITE], &p_opts->mix[OP_MODE]) != NUM_OPS) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'S':
+	    p_opts->dev_sim = 1;
+	    break;
+	case '?':
+	default:
+	    print_usage(argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    if ((p_opts->procs < 1) || (p_opts->max_threads < 1) || (p_opts->ops < 1) ||
+	(p_opts->mix[OP_READ] < 0) || (p_opts->mix[OP_WRITE] < 0) ||
+	(p_opts->mix[OP_MODE] < 0) ||
+	!(p_opts->mix[OP_READ] + p_opts->mix[OP_WRITE] + p_opts->mix[OP_MODE])) {
+	print_usage(argv[0]);
+	exit(EXIT_FAILURE);
+    }
+}
+
+/* Write an in-band command; returns 0 or -1 */
+static int write_cmd(int fd, const char *cmd)
+{
+    return (write(fd, cmd, strlen(cmd)) == (ssize_t)strlen(cmd)) ? 0 : -1;
+}
+
+static int64_t ts_ns(const struct timespec *p_ts)
+{
+    return (int64_t)p_ts->tv_sec * 1000000000 + p_ts->tv_nsec;
+}
+
+/* Pick an operation from the mix */
+static int pick_op(const struct stress_opts *p_opts, unsigned int *p_seed)
+{
+    int total = p_opts->mix[OP_READ] + p_opts->mix[OP_WRITE] + p_opts->mix[OP_MODE];
+    int r = rand_r(p_seed) % total;
+
+    for (int op = 0; op < NUM_OPS - 1; op++) {
+	if (r < p_opts->mix[op]) {
+	    return op;
+	}
+	r -= p_opts->mix[op];
+    }
+    return NUM_OPS - 1;
+}
+
+/*
+ * Open the device, wait for the start pipe to close, then run the
+ * operations back to back, timing each one.
+ */
+static void *stress_thread(void *arg)
+{
+    struct thread_args *p_args = arg;
+    const struct stress_opts *p_opts = p_args->p_opts;
+    int switched = 0;
+    struct timespec start, end;
+    unsigned char val;
+    char dummy;
+    int fd;
+    int ok;
+
+    if ((fd = open(p_opts->dev, O_RDWR)) == -1) {
+	perror(p_opts->dev);
+	exit(EXIT_FAILURE);
+    }
+
+    /* All threads in all processes start together, at EOF */
+    (void) read(p_args->start_fd, &dummy, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &p_args->p_result->start);
+    for (int i = 0; i < p_opts->ops; i++) {
+	struct op_result *p_op = &p_args->p_ops[i];
+
+	p_op->op = pick_op(p_opts, &p_args->seed);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	switch (p_op->op) {
+	case OP_READ:
+	    ok = (read(fd, &val, 1) == 1);
+	    break;
+	case OP_WRITE:
+	    val = rand_r(&p_args->seed);
+	    ok = (write(fd, &val, 1) == 1);
+	    break;
+	default:
+	    /* Away from the starting mode, then back */
+	    switched = !switched;
+	    if (p_opts->dev_sim) {
+		ok = !write_cmd(fd, switched ? SIM_OFF_CMD : SIM_ON_CMD);
+	    } else {
+		ok = !write_cmd(fd, switched ? FSIM_ON_CMD : FSIM_OFF_CMD);
+	    }
+	    break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	p_op->ns = ts_ns(&end) - ts_ns(&start);
+	p_op->err = !ok;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &p_args->p_result->end);
+
+    close(fd);
+    return NULL;
+}
+
+/* One process's share of a round: threads threads, then exit */
+static void stress_proc(const struct stress_opts *p_opts, int start_fd,
+			int proc, int threads, struct op_result *p_ops,
+			struct thread_result *p_results)
+{
+    pthread_t tids[threads];
+    struct thread_args args[threads];
+
+    for (int i = 0; i < threads; i++) {
+	int slot = proc * threads + i;
+
+	args[i].p_opts = p_opts;
+	args[i].start_fd = start_fd;
+	args[i].seed = slot * 7919 + threads;
+	args[i].p_ops = &p_ops[(size_t)slot * p_opts->ops];
+	args[i].p_result = &p_results[slot];
+	if (pthread_create(&tids[i], NULL, stress_thread, &args[i])) {
+	    perror("pthread_create");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    for (int i = 0; i < threads; i++) {
+	pthread_join(tids[i], NULL);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/* Thread counts double, ending on max_threads even if not a power of 2 */
+static int next_threads(int threads, int max_threads)
+{
+    if (threads == max_threads) {
+	return max_threads + 1;
+    }
+    return (threads * 2 > max_threads) ? max_threads : threads * 2;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t lat_a = *(const uint32_t *)a;
+    uint32_t lat_b = *(const uint32_t *)b;
+
+    return (lat_a > lat_b) - (lat_a < lat_b);
+}
+
+/* Latency at percentile pct of n sorted latencies, in us */
+static double pctl_us(const uint32_t *p_lat, size_t n, double pct)
+{
+    size_t i = (size_t)(pct / 100 * (n - 1) + 0.5);
+
+    return p_lat[i] / 1000.0;
+}
+
+/* Throughput over the whole round, and latencies per operation */
+static void report(const struct stress_opts *p_opts, int threads,
+		   const struct op_result *p_ops,
+		   const struct thread_result *p_results)
+{
+    size_t total = (size_t)p_opts->procs * threads * p_opts->ops;
+    int64_t first = INT64_MAX, last = 0;
+    uint32_t *p_lat;
+    size_t n;
+    int errors;
+
+    for (int i = 0; i < p_opts->procs * threads; i++) {
+	if (ts_ns(&p_results[i].start) < first) {
+	    first = ts_ns(&p_results[i].start);
+	}
+	if (ts_ns(&p_results[i].end) > last) {
+	    last = ts_ns(&p_results[i].end);
+	}
+    }
+
+    if (!(p_lat = malloc(total * sizeof(uint32_t)))) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+    }
+    for (int op = 0; op < NUM_OPS; op++) {
+	n = 0;
+	errors = 0;
+	for (size_t i = 0; i < total; i++) {
+	    if (p_ops[i].op == op) {
+		p_lat[n++] = p_ops[i].ns;
+		errors += p_ops[i].err;
+	    }
+	}
+	if (!n) {
+	    continue;
+	}
+	qsort(p_lat, n, sizeof(uint32_t), cmp_u32);
+	printf("%5d %7d %10.0f %-6s %8zu %9.1f %9.1f %9.1f %9.1f %9.1f %6d\n",
+	       p_opts->procs, threads, total * 1e9 / (last - first), op_names[op],
+	       n, pctl_us(p_lat, n, 50), pctl_us(p_lat, n, 90),
+	       pctl_us(p_lat, n, 99), pctl_us(p_lat, n, 99.9),
+	       p_lat[n - 1] / 1000.0, errors);
+    }
+    free(p_lat);
+}
+
+int main(int argc, char *argv[])
+{
+    struct stress_opts opts = {
+	.dev = I2C_SOIL_DEV,
+	.procs = DEFAULT_PROCS,
+	.max_threads = DEFAULT_MAX_THREADS,
+	.ops = DEFAULT_OPS,
+	.mix = { 8, 1, 1 },
+    };
+    struct op_result *p_ops;
+    struct thread_result *p_results;
+    size_t ops_len, results_len;
+    int start_pipe[2];
+    int status;
+    int ctl_fd;
+
+    parse_options(argc, argv, &opts);
+
+    /* Known state: device sim mode, so reads don't wait on the sensor */
+    if (((ctl_fd = open(opts.dev, O_RDWR)) == -1) ||
+	write_cmd(ctl_fd, SIM_ON_CMD)) {
+	perror(opts.dev);
+	exit(EXIT_FAILURE);
+    }
+
+    /* Sized for the largest round, shared with the children */
+    ops_len = (size_t)opts.procs * opts.max_threads * opts.ops * sizeof(struct op_result);
+    results_len = (size_t)opts.procs * opts.max_threads * sizeof(struct thread_result);
+    p_ops = mmap(NULL, ops_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    p_results = mmap(NULL, results_len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ((p_ops == MAP_FAILED) || (p_results == MAP_FAILED)) {
+	perror("mmap");
+	exit(EXIT_FAILURE);
+    }
+
+    printf("procs threads      ops/s op         count    p50_us    p90_us    p99_us   p999_us    max_us errors\n");
+    for (int threads = 1; threads <= opts.max_threads;
+	 threads = next_threads(threads, opts.max_threads)) {
+	if (pipe(start_pipe) == -1) {
+	    perror("pipe");
+	    exit(EXIT_FAILURE);
+	}
+	fflush(stdout);		/* Or the children print it again */
+	for (int proc = 0; proc < opts.procs; proc++) {
+	    switch (fork()) {
+	    case -1:
+		perror("fork");
+		exit(EXIT_FAILURE);
+	    case 0:
+		close(start_pipe[1]);
+		stress_proc(&opts, start_pipe[0], proc, threads, p_ops, p_results);
+		break;		/* Not reached, stress_proc exits */
+	    default:
+		break;
+	    }
+	}
+
+	/* Give the threads time to open the device, then start them */
+	close(start_pipe[0]);
+	sleep(1);
+	close(start_pipe[1]);
+
+	for (int proc = 0; proc < opts.procs; proc++) {
+	    if ((wait(&status) == -1) || !WIFEXITED(status) ||
+		(WEXITSTATUS(status) != EXIT_SUCCESS)) {
+		fprintf(stderr, "%s: worker process failed\n", argv[0]);
+		exit(EXIT_FAILURE);
+	    }
+	}
+	report(&opts, threads, p_ops, p_results);
+    }
+
+    (void) write_cmd(ctl_fd, SIM_OFF_CMD);
+    close(ctl_fd);
+    exit(EXIT_SUCCESS);
+}
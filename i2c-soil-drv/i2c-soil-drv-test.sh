@@ -9,19 +9,24 @@
 # Write 50 random values to driver and verify reads back correctly.
 # echo $((1 + $RANDOM % 10))
 # $RANDOM returns 0-32767
+#
+# Uses per-file sim mode on one open file (fd 3), so the device's own
+# sim mode is never touched: several runs can go in parallel, and the
+# daemon keeps reading the real sensor meanwhile. Optional argument is
+# the device to test, default /dev/i2c-soil-drv.
 
-I2C_SOIL_DEV=/dev/i2c-soil-drv
-SIM_ON_CMD=sim-on
-SIM_OFF_CMD=sim-off
+I2C_SOIL_DEV=${1:-/dev/i2c-soil-drv}
+FSIM_ON_CMD=fsim-on
+FSIM_OFF_CMD=fsim-off
 
-# Set sim mode active in driver
+# Set sim mode active for fd 3 only
 sim_on() {
-    echo -n $SIM_ON_CMD > $I2C_SOIL_DEV
+    echo -n $FSIM_ON_CMD >&3
 }
 
-# Set sim mode inactive in driver
+# Set sim mode inactive for fd 3
 sim_off() {
-    echo -n $SIM_OFF_CMD > $I2C_SOIL_DEV
+    echo -n $FSIM_OFF_CMD >&3
 }
 
 # Takes a single decimal number as a string, convert it to byte data,
@@ -32,10 +37,10 @@ write_and_verify() {
     HEX_IN=`printf "\x%02x" $1`
 	  
     # Write then read w/ dd - status=none to avoid record output
-    echo -ne "$HEX_IN" > $I2C_SOIL_DEV
+    echo -ne "$HEX_IN" >&3
 
     # Add leading "\x" so HEX_OUT matches HEX_IN
-    HEX_OUT="\x"`dd if=$I2C_SOIL_DEV count=1 bs=1 status=none|od -t x1|awk '{ print $2}'`
+    HEX_OUT="\x"`dd count=1 bs=1 status=none <&3|od -t x1|awk '{ print $2}'`
 
     if [ $HEX_IN != $HEX_OUT ]; then
 	echo "FAILED"
@@ -45,6 +50,7 @@ write_and_verify() {
     fi
 }
 
+exec 3<> $I2C_SOIL_DEV
 sim_on
 
 echo -n "Testing write/read 0..255... "
@@ -70,3 +76,4 @@ done
 echo "PASS"
 
 sim_off
+exec 3>&-
@@ -0,0 +1,332 @@
+/**************************************************************************
+ *
+ * i2c-soil-slave.c
+ *
+ * i2c slave backend emulating an Adafruit seesaw soil sensor, so the
+ * driver's real i2c path (i2c_master_send/i2c_master_recv, re-reads,
+ * probe) can be tested and benchmarked without hardware. Needs an
+ * adapter with slave support, eg i2c-gpio loopback wiring or a second
+ * bus wired to the first. Instantiate at 0x36 on bus 1 with:
+ *
+ *   echo slave-soil 0x1036 > /sys/bus/i2c/devices/i2c-1/new_device
+ *
+ * It answers the moisture register (0x0f 0x10) and the status HW_ID
+ * register (0x00 0x01). Moisture readings come from the readings
+ * attribute of the slave device, a list of values returned in turn,
+ * over and over, eg:
+ *
+ *   echo "0x2a0 0x300 0x141 0x1000" > /sys/bus/i2c/devices/1-1036/readings
+ *
+ * Values over 4095 are out of bounds, so make the driver re-read.
+ *
+ * A slave callback runs in the adapter's interrupt handler and can't
+ * hold the bus, so delay_us emulates the conversion time the way the
+ * chip shows it: a read sooner than delay_us after the register write
+ * returns 0xffff, which the driver also re-reads. stats shows how many
+ * reads were answered and how many of those came too early.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/version.h>
+
+#include "i2c-soil-drv-int.h"
+
+MODULE_AUTHOR("Thomas Ames");
+MODULE_LICENSE("Dual BSD/GPL");
+
+struct i2c_soil_slave
+{
+    spinlock_t lock;		/* Callback runs in irq context */
+    u8 reg[2];			/* Register base/offset last written */
+    unsigned int reg_len;
+    u8 buf[2];			/* Reply to the current read */
+    unsigned int buf_pos;
+    ktime_t ready;		/* When the register's data is ready */
+    u16 readings[I2C_SOIL_SLAVE_MAX_READINGS];
+    unsigned int num_readings;
+    unsigned int next_reading;	/* Index of the next moisture reading */
+    unsigned int delay_us;	/* Emulated conversion time */
+    u8 hw_id;			/* HW_ID register */
+    unsigned int reads;		/* Moisture reads answered */
+    unsigned int early_reads;	/* ... of which before delay_us */
+};
+
+/* Build the reply to a read of the register last written */
+static void i2c_soil_slave_fill(struct i2c_soil_slave *p_slave)
+{
+    u16 reply = 0xffff;		/* Unknown register, or not ready yet */
+
+    if ((p_slave->reg_len == 2) &&
+	(p_slave->reg[0] == I2C_TOUCH_BASE_ADDR) &&
+	(p_slave->reg[1] == I2C_TOUCH_OFFSET)) {
+	p_slave->reads++;
+	if (ktime_before(ktime_get(), p_slave->ready)) {
+	    p_slave->early_reads++;
+	} else {
+	    reply = p_slave->readings[p_slave->next_reading];
+	    p_slave->next_reading =
+		(p_slave->next_reading + 1) % p_slave->num_readings;
+	}
+    } else if ((p_slave->reg_len == 2) &&
+	       (p_slave->reg[0] == I2C_STATUS_BASE_ADDR) &&
+	       (p_slave->reg[1] == I2C_STATUS_HW_ID)) {
+	reply = (p_slave->hw_id << 8) | 0xff;
+    }
+
+    /* seesaw registers are big endian */
+    p_slave->buf[0] = reply >> 8;
+    p_slave->buf[1] = reply & 0xff;
+    p_slave->buf_pos = 0;
+}
+
+/*
+ * The i2c core calls this for each event on the slave address. Every
+ * byte is ACKed; bytes past the register pair are ignored, and reads
+ * past the 2 byte reply return 0xff.
+ */
+static int i2c_soil_slave_cb(struct i2c_client *client,
+			     enum i2c_slave_event event, u8 *val)
+{
+    struct i2c_soil_slave *p_slave = i2c_get_clientdata(client);
+
+    spin_lock(&p_slave->lock);
+    switch (event) {
+    case I2C_SLAVE_WRITE_REQUESTED:
+	p_slave->reg_len = 0;
+	break;
+    case I2C_SLAVE_WRITE_RECEIVED:
+	if (p_slave->reg_len < sizeof(p_slave->reg)) {
+	    p_slave->reg[p_slave->reg_len++] = *val;
+	    if (p_slave->reg_len == sizeof(p_slave->reg)) {
+		p_slave->ready = ktime_add_us(ktime_get(), p_slave->delay_us);
+	    }
+	}
+	break;
+    case I2C_SLAVE_READ_REQUESTED:
+	i2c_soil_slave_fill(p_slave);
+	*val = p_slave->buf[0];
+	break;
+    case I2C_SLAVE_READ_PROCESSED:
+	/* The byte in *val went out; supply the next one */
+	p_slave->buf_pos++;
+	*val = (p_slave->buf_pos < sizeof(p_slave->buf)) ?
+	    p_slave->buf[p_slave->buf_pos] : 0xff;
+	break;
+    case I2C_SLAVE_STOP:
+    default:
+	break;
+    }
+    spin_unlock(&p_slave->lock);
+    return 0;
+}
+
+static ssize_t readings_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+    struct i2c_soil_slave *p_slave = dev_get_drvdata(dev);
+    u16 readings[I2C_SOIL_SLAVE_MAX_READINGS];
+    unsigned int num_readings;
+    ssize_t len = 0;
+
+    spin_lock_irq(&p_slave->lock);
+    num_readings = p_slave->num_readings;
+    memcpy(readings, p_slave->readings, num_readings * sizeof(u16));
+    spin_unlock_irq(&p_slave->lock);
+
+    for (int i = 0; i < num_readings; i++) {
+	len += sysfs_emit_at(buf, len, "%s0x%03x", i ? " " : "", readings[i]);
+    }
+    len += sysfs_emit_at(buf, len, "\n");
+    return len;
+}
+
+/* Replace the list of readings, restarting from the first */
+static ssize_t readings_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+    struct i2c_soil_slave *p_slave = dev_get_drvdata(dev);
+    u16 readings[I2C_SOIL_SLAVE_MAX_READINGS];
+    unsigned int num_readings = 0;
+    char *p_copy, *p_cur, *p_tok;
+    int retval = 0;
+
+    p_copy = kstrndup(buf, count, GFP_KERNEL);
+    if (!p_copy) {
+	return -ENOMEM;
+    }
+    p_cur = p_copy;
+    while ((p_tok = strsep(&p_cur, " \t\n"))) {
+	if (!*p_tok) {
+	    continue;
+	}
+	if (num_readings == I2C_SOIL_SLAVE_MAX_READINGS) {
+	    retval = -E2BIG;
+	    break;
+	}
+	if ((retval = kstrtou16(p_tok, 0, &readings[num_readings++])) < 0) {
+	    break;
+	}
+    }
+    kfree(p_copy);
+    if (!retval && !num_readings) {
+	retval = -EINVAL;
+    }
+    if (retval) {
+	return retval;
+    }
+
+    spin_lock_irq(&p_slave->lock);
+    memcpy(p_slave->readings, readings, num_readings * sizeof(u16));
+    p_slave->num_readings = num_readings;
+    p_slave->next_reading = 0;
+    spin_unlock_irq(&p_slave->lock);
+    return count;
+}
+static DEVICE_ATTR_RW(readings);
+
+static ssize_t delay_us_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+    struct i2c_soil_slave *p_slave = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(p_slave->delay_us));
+}
+
+static ssize_t delay_us_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+    struct i2c_soil_slave *p_slave = dev_get_drvdata(dev);
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if (val > I2C_SOIL_MAX_CONV_DELAY_US) {
+	return -EINVAL;
+    }
+    WRITE_ONCE(p_slave->delay_us, val);
+    return count;
+}
+static DEVICE_ATTR_RW(delay_us);
+
+static ssize_t hw_id_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+    struct i2c_soil_slave *p_slave = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "0x%02x\n", READ_ONCE(p_slave->hw_id));
+}
+
+/* Anything but a seesaw id makes the driver's probe give up */
+static ssize_t hw_id_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+    struct i2c_soil_slave *p_slave = dev_get_drvdata(dev);
+    u8 val;
+    int retval;
+
+    if ((retval = kstrtou8(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    WRITE_ONCE(p_slave->hw_id, val);
+    return count;
+}
+static DEVICE_ATTR_RW(hw_id);
+
+/* "name value" lines, like the driver's bench_result; write 0 to clear */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+    struct i2c_soil_slave *p_slave = dev_get_drvdata(dev);
+    unsigned int reads, early_reads;
+
+    spin_lock_irq(&p_slave->lock);
+    reads = p_slave->reads;
+    early_reads = p_slave->early_reads;
+    spin_unlock_irq(&p_slave->lock);
+
+    return sysfs_emit(buf, "reads %u\nearly_reads %u\n", reads, early_reads);
+}
+
+static ssize_t stats_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+    struct i2c_soil_slave *p_slave = dev_get_drvdata(dev);
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if (val) {
+	return -EINVAL;
+    }
+    spin_lock_irq(&p_slave->lock);
+    p_slave->reads = 0;
+    p_slave->early_reads = 0;
+    spin_unlock_irq(&p_slave->lock);
+    return count;
+}
+static DEVICE_ATTR_RW(stats);
+
+static struct attribute *i2c_soil_slave_attrs[] = {
+    &dev_attr_readings.attr,
+    &dev_attr_delay_us.attr,
+    &dev_attr_hw_id.attr,
+    &dev_attr_stats.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(i2c_soil_slave);
+
+static int i2c_soil_slave_probe(struct i2c_client *client)
+{
+    struct i2c_soil_slave *p_slave;
+
+    p_slave = devm_kzalloc(&client->dev, sizeof(*p_slave), GFP_KERNEL);
+    if (!p_slave) {
+	return -ENOMEM;
+    }
+    spin_lock_init(&p_slave->lock);
+    p_slave->readings[0] = I2C_SOIL_SLAVE_READING;
+    p_slave->num_readings = 1;
+    p_slave->delay_us = I2C_SOIL_SLAVE_DELAY_US;
+    p_slave->hw_id = I2C_HW_ID_SAMD09;
+    i2c_set_clientdata(client, p_slave);
+
+    return i2c_slave_register(client, i2c_soil_slave_cb);
+}
+
+static void i2c_soil_slave_remove(struct i2c_client *client)
+{
+    i2c_slave_unregister(client);
+}
+
+static const struct i2c_device_id i2c_soil_slave_id[] = {
+    { "slave-soil", 0 },
+    { }
+};
+MODULE_DEVICE_TABLE(i2c, i2c_soil_slave_id);
+
+static struct i2c_driver i2c_soil_slave_driver = {
+    .driver = {
+	.name = "i2c-soil-slave",
+	.dev_groups = i2c_soil_slave_groups,
+    },
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    .probe = i2c_soil_slave_probe,
+#else
+    .probe_new = i2c_soil_slave_probe,
+#endif
+    .remove = i2c_soil_slave_remove,
+    .id_table = i2c_soil_slave_id,
+};
+module_i2c_driver(i2c_soil_slave_driver);
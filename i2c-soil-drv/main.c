@@ -10,8 +10,18 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/cdev.h>
+#include <linux/device.h>
 #include <linux/i2c.h>
 #include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/version.h>
 
 #include "i2c-soil-drv-int.h"
 
@@ -25,34 +35,131 @@ MODULE_LICENSE("Dual BSD/GPL");
 dev_t i2c_soil_dev_major = 0;
 dev_t i2c_soil_dev_minor = 0;
 
-#define NUM_MINORS 1
+/*
+ * Sensor n is on adapter i2c_buses[n] at address i2c_addrs[n] (default
+ * I2C_BUS_ADDR), eg: insmod i2c-soil-drv.ko i2c_buses=1,1,3 i2c_addrs=0x36,0x37
+ */
+static int i2c_buses[I2C_SOIL_MAX_DEVS] = { I2C_BUS_NUM };
+static unsigned int num_i2c_buses = 1;
+module_param_array(i2c_buses, int, &num_i2c_buses, 0444);
+MODULE_PARM_DESC(i2c_buses, "i2c adapter number of each sensor");
+
+static int i2c_addrs[I2C_SOIL_MAX_DEVS] = { I2C_BUS_ADDR };
+static unsigned int num_i2c_addrs = 1;
+module_param_array(i2c_addrs, int, &num_i2c_addrs, 0444);
+MODULE_PARM_DESC(i2c_addrs, "i2c address of each sensor");
+
+/*
+ * Adapters to scan for more sensors, over addresses scan_addr_min to
+ * scan_addr_max, eg: insmod i2c-soil-drv.ko scan_buses=1,3
+ */
+static int scan_buses[I2C_SOIL_MAX_DEVS];
+static unsigned int num_scan_buses;
+module_param_array(scan_buses, int, &num_scan_buses, 0444);
+MODULE_PARM_DESC(scan_buses, "i2c adapters to scan for sensors");
+
+int i2c_soil_scan_addr_min = I2C_SOIL_SCAN_ADDR_MIN;
+module_param_named(scan_addr_min, i2c_soil_scan_addr_min, int, 0444);
+MODULE_PARM_DESC(scan_addr_min, "First i2c address to scan");
 
-struct i2c_soil_dev i2c_soil_device;
+int i2c_soil_scan_addr_max = I2C_SOIL_SCAN_ADDR_MAX;
+module_param_named(scan_addr_max, i2c_soil_scan_addr_max, int, 0444);
+MODULE_PARM_DESC(scan_addr_max, "Last i2c address to scan");
+
+/*
+ * Real-time sampling: bus workers run SCHED_FIFO, optionally pinned to
+ * CPU rt_cpu, and periodic sampling is paced by hrtimers, see sched.c.
+ */
+bool i2c_soil_rt_sched;
+module_param_named(rt_sched, i2c_soil_rt_sched, bool, 0444);
+MODULE_PARM_DESC(rt_sched, "Real-time bus workers and sample pacing");
+
+int i2c_soil_rt_cpu = -1;
+module_param_named(rt_cpu, i2c_soil_rt_cpu, int, 0444);
+MODULE_PARM_DESC(rt_cpu, "CPU to pin bus workers to, -1=any");
+
+/*
+ * Autonomous watering, see pump.c: the pump line's offset on gpio chip
+ * pump_chip, and the sensor that waters through it.
+ */
+static int pump_gpio = -1;
+module_param(pump_gpio, int, 0444);
+MODULE_PARM_DESC(pump_gpio, "Pump gpio line offset, -1=no pump");
+
+static char *pump_chip = I2C_SOIL_PUMP_CHIP;
+module_param(pump_chip, charp, 0444);
+MODULE_PARM_DESC(pump_chip, "gpio chip label of the pump line");
+
+static int pump_sensor = 0;
+module_param(pump_sensor, int, 0444);
+MODULE_PARM_DESC(pump_sensor, "Sensor that controls the pump");
+
+static unsigned int sample_period_ms = 0;
+module_param(sample_period_ms, uint, 0444);
+MODULE_PARM_DESC(sample_period_ms, "Periodic sampling interval, 0=sample on read only");
+
+static struct class i2c_soil_class = {
+    .name = "i2c-soil-drv",
+};
+
+/* Configured sensors first, then any found by scanning */
+static struct i2c_soil_dev *i2c_soil_devices[I2C_SOIL_MAX_DEVS];
+static int i2c_soil_num_devs;
+static DEFINE_MUTEX(i2c_soil_devices_lock); /* Scans add sensors concurrently */
 
 int i2c_soil_drv_open(struct inode *inode, struct file *filp)
 {
+    struct i2c_soil_file *p_file;
+
     PDEBUG("open");
 
+    p_file = kzalloc(sizeof(*p_file), GFP_KERNEL);
+    if (!p_file) {
+	return -ENOMEM;
+    }
+
     /*
      * Use container_of macro to get pointer to the i2c_soil_dev and
-     * store in filp->private_data. If i2c_soil_dev has no fields
+     * store it in the per-file state. If i2c_soil_dev has no fields
      * other than the cdev, then this macro isn't explicitly
      * necessary, as p_cdev == p_i2c_soil_dev.
      */
-    filp->private_data = container_of(inode->i_cdev, struct i2c_soil_dev, cdev);
-    PDEBUG("filp->private_data = %p, inode->i_cdev = %p, &i2c_soil_device = %p",
-	   filp->private_data, inode->i_cdev, &i2c_soil_device);
+    p_file->p_dev = container_of(inode->i_cdev, struct i2c_soil_dev, cdev);
+    INIT_LIST_HEAD(&p_file->coalesce_node);
+    filp->private_data = p_file;
+
+    /* read_iter honors IOCB_NOWAIT, so io_uring may issue reads inline */
+    filp->f_mode |= FMODE_NOWAIT;
+
+    /* The newest existing sample counts as unseen by this file */
+    spin_lock(&p_file->p_dev->sample_lock);
+    p_file->seen_seq = p_file->p_dev->sample_seq;
+    if (p_file->seen_seq) {
+	p_file->seen_seq--;
+    }
+    spin_unlock(&p_file->p_dev->sample_lock);
+
+    PDEBUG("p_file = %p, inode->i_cdev = %p, p_dev = %p",
+	   p_file, inode->i_cdev, p_file->p_dev);
     return 0;
 }
 
 int i2c_soil_drv_release(struct inode *inode, struct file *filp)
 {
+    struct i2c_soil_file *p_file = filp->private_data;
+
     PDEBUG("release");
 
+    spin_lock(&p_file->p_dev->sample_lock);
+    list_del(&p_file->coalesce_node);
+    spin_unlock(&p_file->p_dev->sample_lock);
+
     /*
-     * Nothing to do - release is the opposite of open, but we don't
-     * do anything in open that needs to be undone.
+     * An acquisition this file requested may still be in flight;
+     * that's harmless, since it only updates the device's latest
+     * sample.
      */
+    kfree(filp->private_data);
     return 0;
 }
 
@@ -87,7 +194,8 @@ int i2c_soil_drv_release(struct inode *inode, struct file *filp)
  *   0x3c0 - (max) in saturated soil
  *   0x3f8 - held between fingers
  */
-ssize_t i2c_soil_drv_single_read_sensor(struct i2c_client *p_i2c_client)
+ssize_t i2c_soil_drv_single_read_sensor(struct i2c_client *p_i2c_client,
+					unsigned int conv_delay_us)
 {
     ssize_t retval = 0;
     char i2c_buf[2];		/* 2 byte buffer for reg addr and read data */
@@ -110,8 +218,10 @@ ssize_t i2c_soil_drv_single_read_sensor(struct i2c_client *p_i2c_client)
     /*
      * After sending the register address info, need a short delay for the
      * part to respond with data. Adafruit code uses a 5ms delay.
+     * fsleep rather than msleep, which rounds short delays up to
+     * jiffies and would dominate the sample time at HZ=100.
      */
-    msleep(I2C_MSEC_DELAY);
+    fsleep(conv_delay_us);
 
     /* Read 2 byte register pair */
     retval = i2c_master_recv(p_i2c_client, i2c_buf, sizeof(i2c_buf));
@@ -124,8 +234,12 @@ ssize_t i2c_soil_drv_single_read_sensor(struct i2c_client *p_i2c_client)
 	return -EIO;		/* What to return? -EIO, -EAGAIN, -EBUSY? */
     }
 
-    /* Merge bytes into a single 16-bit value and return */
-    retval = ((i2c_buf[0] << 8) | i2c_buf[1]);
+    /*
+     * Merge bytes into a single 16-bit value and return. The kernel
+     * builds with -funsigned-char, so the casts only spell out that
+     * these are bytes, not small signed numbers.
+     */
+    retval = (((u8)i2c_buf[0] << 8) | (u8)i2c_buf[1]);
     PDEBUG("Raw sensor data: 0x%04lx", retval);
     return retval;
 }
@@ -136,104 +250,920 @@ ssize_t i2c_soil_drv_single_read_sensor(struct i2c_client *p_i2c_client)
  * https://github.com/adafruit/Adafruit_CircuitPython_seesaw/blob/main/adafruit_seesaw/seesaw.py, which throws out values > 4095 and tries at
  * most 3 re-reads.
  *
- * After a successful, in-range read, return the reading normalized to
- * a one-byte value, 0 = dry, 0xff = wet
+ * The conversion delay and number of re-reads come from the sensor's
+ * sysfs tunables (defaults I2C_MSEC_DELAY and I2C_MAX_REREADS). If
+ * p_rereads isn't NULL, the number of re-reads taken is stored there.
  *
- * Returns normalized sensor reading or -ERRNO on error.
+ * Returns the in-range raw sensor reading or -ERRNO on error.
  */
-ssize_t i2c_soil_drv_read_sensor(struct i2c_client *p_i2c_client)
+ssize_t i2c_soil_drv_read_sensor(struct i2c_soil_dev *p_dev,
+				 unsigned int *p_rereads)
 {
+    unsigned int conv_delay_us = READ_ONCE(p_dev->conv_delay_us);
+    unsigned int max_rereads = READ_ONCE(p_dev->max_rereads);
     ssize_t reading;
+    int i;
 
     /*
      * Including initial assignment in for init clause caused
      * (erroneous) uninitialized variable warnings?
      */
-    reading = i2c_soil_drv_single_read_sensor(p_i2c_client);
+    reading = i2c_soil_drv_single_read_sensor(p_dev->p_i2c_client,
+					      conv_delay_us);
 
-    for (int i=0;
-	 (I2C_READING_OUT_OF_BOUNDS(reading) && (i < I2C_MAX_REREADS));
+    for (i=0;
+	 (I2C_READING_OUT_OF_BOUNDS(reading) && (i < max_rereads));
 	 i++) {
 	/* Sample code has a short delay before re-read */
-	msleep(I2C_MSEC_DELAY);
-	reading = i2c_soil_drv_single_read_sensor(p_i2c_client);
+	fsleep(conv_delay_us);
+	reading = i2c_soil_drv_single_read_sensor(p_dev->p_i2c_client,
+						  conv_delay_us);
+    }
+    if (p_rereads) {
+	*p_rereads = i;
     }
 
     /* What to return? -EIO, -EAGAIN, -EBUSY? */
     if (I2C_READING_OUT_OF_BOUNDS(reading))	return -EIO;
-    else if (reading < I2C_MIN_RAW_DRY_READING)	return I2C_MIN_DRY_READING;
-    else if (reading > I2C_MAX_RAW_WET_READING)	return I2C_MAX_WET_READING;
-    else return (reading - I2C_MIN_RAW_DRY_READING);
+    else return reading;
 }
 
-/* Returns negative on error, >=0 indicated # of bytes read. */
-ssize_t i2c_soil_drv_read(struct file *filp, char __user *buf, size_t count,
-			  loff_t *f_pos)
+/*
+ * Run an in-range raw reading through the moving average filter and
+ * return the filtered raw reading. Called with sample_lock held, which
+ * keeps the filter state consistent with sysfs updates.
+ */
+static int i2c_soil_drv_filter(struct i2c_soil_dev *p_dev, int raw)
 {
-    /* Probably safe to assume the kernel doesn't pass a null filp */
-    struct i2c_soil_dev *p_i2c_soil_dev = (struct i2c_soil_dev *) filp->private_data;
-    char moisture = 0;
+    if (p_dev->filter_len == p_dev->filter_depth) {
+	p_dev->filter_sum -= p_dev->filter_buf[p_dev->filter_pos];
+    } else {
+	p_dev->filter_len++;
+    }
+    p_dev->filter_buf[p_dev->filter_pos] = raw;
+    p_dev->filter_sum += raw;
+    p_dev->filter_pos = (p_dev->filter_pos + 1) % p_dev->filter_depth;
+    return p_dev->filter_sum / p_dev->filter_len;
+}
+
+/*
+ * Return a raw reading normalized to a one-byte value, 0 = dry, 0xff
+ * = wet. Readings below raw_dry return 0, above raw_wet return 255.
+ * Called with sample_lock held, so the dry/wet pair is consistent.
+ */
+static ssize_t i2c_soil_drv_normalize(struct i2c_soil_dev *p_dev, int raw)
+{
+    if (raw < p_dev->raw_dry)		return I2C_MIN_DRY_READING;
+    else if (raw > p_dev->raw_wet)	return I2C_MAX_WET_READING;
+    else return ((raw - p_dev->raw_dry) * I2C_MAX_WET_READING /
+		 (p_dev->raw_wet - p_dev->raw_dry));
+}
+
+/* Which side of the dry/wet thresholds a normalized reading is on */
+static int i2c_soil_drv_thresh_state(ssize_t val)
+{
+    if (val <= I2C_MIN_DRY_READING)		return I2C_SOIL_THRESH_DRY;
+    else if (val >= I2C_MAX_WET_READING)	return I2C_SOIL_THRESH_WET;
+    else return I2C_SOIL_THRESH_NONE;
+}
+
+/*
+ * A sample's value at the resolution p_file reads, I2C_SOIL_RES_*, or
+ * -ERRNO if the read failed. Called with sample_lock held, so the
+ * dry/wet pair is consistent.
+ */
+static ssize_t i2c_soil_drv_res_value(struct i2c_soil_file *p_file,
+				      const struct i2c_soil_sample *p_sample)
+{
+    struct i2c_soil_dev *p_dev = p_file->p_dev;
+    int span = p_dev->raw_wet - p_dev->raw_dry;
+
+    if ((p_sample->val < 0) || (p_file->res == I2C_SOIL_RES_8BIT)) {
+	return p_sample->val;
+    }
+    if (p_sample->raw < 0) {
+	/* Simulated, so no raw reading; val is 0-255 */
+	if (p_file->res == I2C_SOIL_RES_RAW) {
+	    return p_dev->raw_dry + p_sample->val * span / I2C_MAX_WET_READING;
+	}
+	return p_sample->val * 0x101;
+    }
+    if (p_file->res == I2C_SOIL_RES_RAW) {
+	return p_sample->raw;
+    }
+    return clamp(p_sample->raw - p_dev->raw_dry, 0, span) * U16_MAX / span;
+}
+
+/* Empty p_file's summary, which then starts from sample seq */
+static void i2c_soil_drv_coalesce_reset(struct i2c_soil_file *p_file, u32 seq)
+{
+    memset(&p_file->agg, 0, sizeof(struct i2c_soil_summary));
+    p_file->next_seq = seq;
+}
+
+/*
+ * p_old is about to be overwritten in the ring: add it to the summary
+ * of each coalescing record mode file that hasn't read it, as long as
+ * it follows on from what the summary already covers. Called with
+ * sample_lock held.
+ */
+static void i2c_soil_drv_coalesce(struct i2c_soil_dev *p_dev,
+				  const struct i2c_soil_sample *p_old)
+{
+    struct i2c_soil_file *p_file;
+    struct i2c_soil_summary *p_agg;
+    ssize_t val;
+
+    list_for_each_entry(p_file, &p_dev->coalesce_list, coalesce_node) {
+	p_agg = &p_file->agg;
+	if (p_file->format != I2C_SOIL_FMT_REC) {
+	    continue;
+	}
+	if (p_agg->count || p_agg->errors) {
+	    if (p_old->seq != p_file->agg_next) {
+		continue;
+	    }
+	} else if ((s32)(p_old->seq - p_file->next_seq) < 0) {
+	    continue;		/* Already read */
+	} else {
+	    p_agg->seq = p_old->seq;
+	    p_agg->first_ns = ktime_to_ns(p_old->timestamp);
+	}
+	p_agg->last_ns = ktime_to_ns(p_old->timestamp);
+	p_file->agg_next = p_old->seq + 1;
+
+	if ((val = i2c_soil_drv_res_value(p_file, p_old)) < 0) {
+	    p_agg->errors++;
+	    continue;
+	}
+	if (!p_agg->count || (val < p_agg->min)) {
+	    p_agg->min = val;
+	}
+	if (!p_agg->count || (val > p_agg->max)) {
+	    p_agg->max = val;
+	}
+	p_agg->sum += val;
+	p_agg->count++;
+    }
+}
+
+/*
+ * Publish a reading as the device's latest sample, then run the pump
+ * (see pump.c), wake any readers and pollers waiting for it and
+ * multicast it (and any threshold crossing) over generic netlink.
+ * p_sample->val is the raw reading, or the 0-255 value if sim, or
+ * -ERRNO; acq_ns is how long an i2c reading took.
+ */
+static void i2c_soil_drv_publish(struct i2c_soil_dev *p_dev,
+				 struct i2c_soil_sample *p_sample, int sim,
+				 u64 acq_ns)
+{
+    int thresh_state = I2C_SOIL_THRESH_NONE;
+    int thresh_changed = 0;
+
+    p_sample->timestamp = ktime_get();
+
+    spin_lock(&p_dev->sample_lock);
+    if (!sim && (p_sample->val >= 0)) {
+	p_sample->raw = i2c_soil_drv_filter(p_dev, p_sample->val);
+	p_sample->val = i2c_soil_drv_normalize(p_dev, p_sample->raw);
+	p_dev->acq_ns = i2c_soil_ewma(p_dev->acq_ns, acq_ns);
+    }
+    p_sample->seq = ++p_dev->sample_seq;
+    if (p_sample->seq > I2C_SOIL_RING_LEN) {
+	i2c_soil_drv_coalesce(p_dev, &p_dev->ring[p_sample->seq & (I2C_SOIL_RING_LEN - 1)]);
+    }
+    p_dev->ring[p_sample->seq & (I2C_SOIL_RING_LEN - 1)] = *p_sample;
+    if (p_sample->val >= 0) {
+	p_dev->last_good = *p_sample;
+	thresh_state = i2c_soil_drv_thresh_state(p_sample->val);
+	if (thresh_state != p_dev->thresh_state) {
+	    p_dev->thresh_state = thresh_state;
+	    thresh_changed = 1;
+	}
+    }
+    spin_unlock(&p_dev->sample_lock);
+
+    /*
+     * Pump first, it's the one with a deadline. Only real readings
+     * count: sim data, replays and virtual sensors never drive it.
+     */
+    if (!sim) {
+	i2c_soil_pump_sample(p_dev, p_sample);
+    }
+
+    wake_up_interruptible_poll(&p_dev->sample_wq, EPOLLIN | EPOLLRDNORM);
+
+    i2c_soil_nl_sample(p_dev, p_sample);
+    if (thresh_changed) {
+	i2c_soil_nl_threshold(p_dev, p_sample, thresh_state);
+    }
+}
+
+/*
+ * Turn device sim mode on or off. Off also stops a replay in progress
+ * (see replay.c), which may be sleeping until its next sample.
+ */
+void i2c_soil_drv_set_sim(struct i2c_soil_dev *p_dev, int on)
+{
+    WRITE_ONCE(p_dev->use_simulation, on);
+    if (!on) {
+	wake_up(&p_dev->replay_wq);
+    }
+}
+
+/*
+ * Stop a burst capture or benchmark run on the bus worker, keeping what
+ * it took so far. p_wq, if any, is where the run sleeps. Called with
+ * the run's lock held; sysfs is gone before the run's cleanup sets
+ * *p_abort for good, so clearing it here can't race with that.
+ */
+void i2c_soil_drv_stop_run(int running, int *p_abort, wait_queue_head_t *p_wq,
+			   struct kthread_work *p_work)
+{
+    if (running) {
+	WRITE_ONCE(*p_abort, 1);
+	if (p_wq) {
+	    wake_up(p_wq);
+	}
+	kthread_flush_work(p_work);
+	WRITE_ONCE(*p_abort, 0);
+    }
+}
+
+/*
+ * Take one reading (i2c or simulated) and publish it. i2c readings
+ * must only be taken on the bus worker (see sched.c), which is what
+ * serializes the sensors sharing a bus.
+ */
+void i2c_soil_drv_acquire(struct i2c_soil_dev *p_dev)
+{
+    struct i2c_soil_sample sample;
+    int sim = READ_ONCE(p_dev->use_simulation);
+    u64 acq_ns = 0;
+    ktime_t start;
+
+    sample.raw = -1;		/* No raw reading behind simulated data */
+    if (p_dev->virtual_dev) {
+	sim = 1;
+	sample.val = i2c_soil_vsensor_value(p_dev);
+    } else if (sim) {
+	sample.val = READ_ONCE(p_dev->sim_data);
+    } else {
+	start = ktime_get();
+	sample.val = i2c_soil_drv_read_sensor(p_dev, NULL);
+	acq_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	i2c_soil_sched_account(p_dev->p_bus, start);
+	if (sample.val < 0) {
+	    printk(KERN_WARNING "i2c-soil-drv: i2c_soil_drv_read_sensor FAILED, retval=%ld\n", sample.val);
+	}
+    }
+    i2c_soil_drv_publish(p_dev, &sample, sim, acq_ns);
+}
+
+/*
+ * Publish a simulated reading, val, without touching the bus; safe
+ * from any thread. Used for replay (see replay.c).
+ */
+void i2c_soil_drv_inject(struct i2c_soil_dev *p_dev, u8 val)
+{
+    struct i2c_soil_sample sample = {
+	.val = val,
+	.raw = -1,
+    };
+
+    i2c_soil_drv_publish(p_dev, &sample, 1, 0);
+}
+
+/* True once the acquisition requested by p_file has completed */
+static bool i2c_soil_drv_sample_ready(struct i2c_soil_file *p_file)
+{
+    return p_file->req_pending &&
+	((s32)(READ_ONCE(p_file->p_dev->sample_seq) - p_file->want_seq) >= 0);
+}
+
+/*
+ * Start one acquisition: simulated readings complete immediately, i2c
+ * readings are queued on the bus worker, so the caller never blocks on
+ * the bus here.
+ */
+static void i2c_soil_drv_kick(struct i2c_soil_dev *p_dev)
+{
+    if (p_dev->use_simulation || p_dev->virtual_dev) {
+	i2c_soil_drv_acquire(p_dev);
+    } else if (!i2c_soil_probe_ready(p_dev)) {
+	i2c_soil_sched_request(p_dev);
+    }
+}
+
+/*
+ * Wait on sample_wq for cond, until deadline if there is one (not 0).
+ * Returns 0, -ETIME if the deadline passed, -ENODEV if the device was
+ * removed meanwhile or -ERESTARTSYS. An hrtimer rather than jiffies,
+ * since read deadlines are often a few ms.
+ */
+#define i2c_soil_drv_wait_until(p_dev, cond, deadline)			\
+    ({									\
+	int __ret = (deadline) ?					\
+	    wait_event_interruptible_hrtimeout((p_dev)->sample_wq,	\
+					       (cond) || READ_ONCE((p_dev)->removed), \
+					       ktime_sub(deadline, ktime_get())) : \
+	    wait_event_interruptible((p_dev)->sample_wq,		\
+				     (cond) || READ_ONCE((p_dev)->removed)); \
+	(!__ret && READ_ONCE((p_dev)->removed)) ? -ENODEV : __ret;	\
+    })
+
+/* Absolute deadline for a blocking read on p_file starting now, or 0 */
+static ktime_t i2c_soil_drv_deadline(struct i2c_soil_file *p_file)
+{
+    u32 deadline_us = READ_ONCE(p_file->deadline_us);
+
+    return deadline_us ? ktime_add_us(ktime_get(), deadline_us) : 0;
+}
+
+/*
+ * Readers of the real sensor wait until the probe has found it.
+ * Returns 0 once it's ready (or simulated), -ENODEV if it's absent,
+ * -EAGAIN or -ERESTARTSYS if still probing, -ETIME if the deadline
+ * passed first. A non-blocking reader getting -EAGAIN has no request
+ * registered yet, so probe_wait makes poll report the probe finishing
+ * instead; the retried read then registers it.
+ */
+static int i2c_soil_drv_wait_ready(struct i2c_soil_file *p_file, int nowait,
+				   ktime_t deadline)
+{
+    struct i2c_soil_dev *p_dev = p_file->p_dev;
+    int retval;
+    int err;
+
+    if (READ_ONCE(p_dev->use_simulation)) {
+	return 0;
+    }
+    if (nowait) {
+	/* Flag first, so a probe finishing in between is seen by poll */
+	smp_store_mb(p_file->probe_wait, 1);
+	if ((retval = i2c_soil_probe_ready(p_dev)) != -EAGAIN) {
+	    WRITE_ONCE(p_file->probe_wait, 0);
+	}
+	return retval;
+    }
+    if ((retval = i2c_soil_probe_ready(p_dev)) == -EAGAIN) {
+	err = i2c_soil_drv_wait_until(p_dev,
+				      (retval = i2c_soil_probe_ready(p_dev)) != -EAGAIN,
+				      deadline);
+	if (err) {
+	    return err;
+	}
+    }
+    WRITE_ONCE(p_file->probe_wait, 0);
+    return retval;
+}
+
+/*
+ * Copy a sample out of the ring into the record format, with the
+ * value at p_file's resolution. Called with sample_lock held.
+ */
+static void i2c_soil_drv_fill_record(struct i2c_soil_file *p_file,
+				     struct i2c_soil_record *p_rec,
+				     const struct i2c_soil_sample *p_sample)
+{
+    memset(p_rec, 0, sizeof(struct i2c_soil_record));
+    p_rec->seq = p_sample->seq;
+    p_rec->timestamp_ns = ktime_to_ns(p_sample->timestamp);
+    p_rec->raw = p_sample->raw;
+    if (p_sample->val < 0) {
+	p_rec->status = p_sample->val;
+    } else {
+	p_rec->value = i2c_soil_drv_res_value(p_file, p_sample);
+	if (p_sample->raw < 0) {
+	    p_rec->flags |= I2C_SOIL_REC_SIM;
+	}
+    }
+}
+
+/*
+ * The read deadline passed: hand back the last good sample instead,
+ * counting it against the file. Returns 0, or -ETIMEDOUT if there has
+ * never been a good sample.
+ */
+static int i2c_soil_drv_last_good(struct i2c_soil_file *p_file,
+				  struct i2c_soil_sample *p_sample)
+{
+    struct i2c_soil_dev *p_dev = p_file->p_dev;
+
+    spin_lock(&p_dev->sample_lock);
+    *p_sample = p_dev->last_good;
+    if (p_sample->seq) {
+	p_file->stale_reads++;
+    }
+    spin_unlock(&p_dev->sample_lock);
+    return p_sample->seq ? 0 : -ETIMEDOUT;
+}
+
+/*
+ * Ask for a sample on behalf of p_file, unless one is already
+ * outstanding. With periodic sampling that's simply the next sample
+ * this file hasn't returned. Otherwise it's a fresh reading, which a
+ * prefetch may already have taken (see i2c_soil_prefetch_want).
+ */
+static void i2c_soil_drv_request_sample(struct i2c_soil_file *p_file)
+{
+    struct i2c_soil_dev *p_dev = p_file->p_dev;
+    int kick = 0;
+
+    spin_lock(&p_dev->sample_lock);
+    if (!p_file->req_pending) {
+	if (READ_ONCE(p_dev->sample_period_ms)) {
+	    p_file->want_seq = p_file->seen_seq + 1;
+	} else {
+	    p_file->want_seq = i2c_soil_prefetch_want(p_dev, ktime_get(), &kick);
+	}
+	p_file->req_pending = 1;
+    }
+    spin_unlock(&p_dev->sample_lock);
+
+    if (kick) {
+	i2c_soil_drv_kick(p_dev);
+    }
+}
+
+/*
+ * In record mode the file offset is a sample sequence number times
+ * sizeof(struct i2c_soil_record). Sequence numbers start at 1, so
+ * offset 0 (a fresh open, or a rewind) means the first sample, and
+ * reads wait for it like any other. Returns the sequence number, or
+ * -EINVAL if pos isn't on a record boundary or is past the last
+ * sequence number.
+ */
+static s64 i2c_soil_drv_pos_to_seq(loff_t pos)
+{
+    u32 rem;
+    u64 seq;
+
+    if (pos < 0) {
+	return -EINVAL;
+    }
+    seq = div_u64_rem(pos, sizeof(struct i2c_soil_record), &rem);
+    if (rem || (seq > U32_MAX)) {
+	return -EINVAL;
+    }
+    return seq ? seq : 1;
+}
+
+static loff_t i2c_soil_drv_seq_to_pos(u32 seq)
+{
+    return (loff_t)seq * sizeof(struct i2c_soil_record);
+}
+
+/* True once sample seq exists (or has already been overwritten) */
+static bool i2c_soil_drv_seq_ready(struct i2c_soil_dev *p_dev, u32 seq)
+{
+    return (s32)(READ_ONCE(p_dev->sample_seq) - seq) >= 0;
+}
+
+/*
+ * Coalescing files: if samples from *p_seq on were overwritten before
+ * being read, copy out their summary and move *p_seq past them. A read
+ * anywhere but where the last one finished (a seek, or pread) drops
+ * the summary, as it no longer follows on. Returns bytes copied or
+ * -ERRNO.
+ */
+static ssize_t i2c_soil_drv_read_summary(struct i2c_soil_file *p_file,
+					 struct iov_iter *to, u32 *p_seq)
+{
+    struct i2c_soil_dev *p_dev = p_file->p_dev;
+    struct i2c_soil_summary sum;
+
+    spin_lock(&p_dev->sample_lock);
+    if (*p_seq != p_file->next_seq) {
+	i2c_soil_drv_coalesce_reset(p_file, *p_seq);
+    }
+    if (list_empty(&p_file->coalesce_node) ||
+	!(p_file->agg.count || p_file->agg.errors)) {
+	spin_unlock(&p_dev->sample_lock);
+	return 0;
+    }
+    if (iov_iter_count(to) < sizeof(struct i2c_soil_summary)) {
+	spin_unlock(&p_dev->sample_lock);
+	return -EINVAL;
+    }
+    sum = p_file->agg;
+    sum.flags = I2C_SOIL_REC_SUMMARY;
+    if (sum.count) {
+	sum.mean = div_u64(sum.sum + sum.count / 2, sum.count);
+    }
+    *p_seq = p_file->agg_next;
+    i2c_soil_drv_coalesce_reset(p_file, *p_seq);
+    spin_unlock(&p_dev->sample_lock);
+
+    if (copy_to_iter(&sum, sizeof(struct i2c_soil_summary), to) !=
+	sizeof(struct i2c_soil_summary)) {
+	return -EFAULT;
+    }
+    return sizeof(struct i2c_soil_summary);
+}
+
+/*
+ * Record mode read, starting at the sample addressed by iocb->ki_pos.
+ * Plain read() walks forward through the samples; pread() can fetch
+ * any range still retained. The offset may point at most one sample
+ * past the newest, in which case the read waits for it exactly like a
+ * byte mode read. Samples older than the retained window are skipped;
+ * the seq field shows where the data really starts, or for coalescing
+ * files a summary comes first instead. Returns bytes copied or -ERRNO,
+ * and advances ki_pos past the last record.
+ */
+static ssize_t i2c_soil_drv_read_records(struct kiocb *iocb,
+					 struct iov_iter *to, int nowait)
+{
+    struct i2c_soil_file *p_file = iocb->ki_filp->private_data;
+    struct i2c_soil_dev *p_dev = p_file->p_dev;
+    struct i2c_soil_record recs[I2C_SOIL_READ_BATCH];
+    ktime_t deadline = i2c_soil_drv_deadline(p_file);
+    struct i2c_soil_sample stale;
+    ssize_t copied = 0;
+    size_t want, got;
+    s64 pos_seq;
+    u32 seq, oldest;
+    int kick;
+    int n;
+    int retval;
+
+    if (iov_iter_count(to) < sizeof(struct i2c_soil_record)) {
+	return -EINVAL;
+    }
+    if ((retval = i2c_soil_drv_wait_ready(p_file, nowait, deadline))) {
+	goto wait_failed;
+    }
+    if ((pos_seq = i2c_soil_drv_pos_to_seq(iocb->ki_pos)) < 0) {
+	return pos_seq;
+    }
+    seq = pos_seq;
+
+    spin_lock(&p_dev->sample_lock);
+    if ((s32)(seq - p_dev->sample_seq) > 1) {
+	spin_unlock(&p_dev->sample_lock);
+	return -EINVAL;		/* Beyond the next sample */
+    }
+    kick = (!READ_ONCE(p_dev->sample_period_ms) &&
+	    ((s32)(seq - p_dev->sample_seq) > 0));
+    spin_unlock(&p_dev->sample_lock);
+
+    if (kick) {
+	i2c_soil_drv_kick(p_dev);
+    }
+
+    if ((retval = i2c_soil_drv_read_summary(p_file, to, &seq)) < 0) {
+	return retval;
+    }
+    copied += retval;
+
+    if (!i2c_soil_drv_seq_ready(p_dev, seq)) {
+	if (nowait) {
+	    return -EAGAIN;	/* Acquisition queued; poll says when */
+	}
+	if ((retval = i2c_soil_drv_wait_until(p_dev,
+					      i2c_soil_drv_seq_ready(p_dev, seq),
+					      deadline))) {
+	    goto wait_failed;
+	}
+    }
+
+    while (iov_iter_count(to) >= sizeof(struct i2c_soil_record)) {
+	want = min_t(size_t, iov_iter_count(to) / sizeof(struct i2c_soil_record),
+		     I2C_SOIL_READ_BATCH);
+
+	spin_lock(&p_dev->sample_lock);
+	oldest = (p_dev->sample_seq < I2C_SOIL_RING_LEN) ? 1 :
+	    p_dev->sample_seq - I2C_SOIL_RING_LEN + 1;
+	if ((s32)(seq - oldest) < 0) {
+	    seq = oldest;
+	}
+	for (n = 0; (n < want) && ((s32)(p_dev->sample_seq - seq) >= 0); n++, seq++) {
+	    i2c_soil_drv_fill_record(p_file, &recs[n],
+				     &p_dev->ring[seq & (I2C_SOIL_RING_LEN - 1)]);
+	}
+	p_file->next_seq = seq;	/* Copied samples aren't summarized */
+	spin_unlock(&p_dev->sample_lock);
+
+	if (!n) {
+	    break;		/* Caught up with the newest sample */
+	}
+
+	/* copy_to_iter returns number copied */
+	got = copy_to_iter(recs, n * sizeof(struct i2c_soil_record), to);
+	copied += got;
+	if (got != n * sizeof(struct i2c_soil_record)) {
+	    seq -= n - got / sizeof(struct i2c_soil_record);
+	    if (!copied) {
+		return -EFAULT;
+	    }
+	    break;
+	}
+    }
+
+    spin_lock(&p_dev->sample_lock);
+    p_file->next_seq = seq;
+    spin_unlock(&p_dev->sample_lock);
+    iocb->ki_pos = i2c_soil_drv_seq_to_pos(seq);
+    return copied;
+
+wait_failed:
+    /* Past the deadline: one stale record, and the offset stays put */
+    if ((retval == -ETIME) &&
+	!(retval = i2c_soil_drv_last_good(p_file, &stale))) {
+	spin_lock(&p_dev->sample_lock);
+	i2c_soil_drv_fill_record(p_file, &recs[0], &stale);
+	spin_unlock(&p_dev->sample_lock);
+	recs[0].flags |= I2C_SOIL_REC_STALE;
+	if (copy_to_iter(recs, sizeof(struct i2c_soil_record), to) !=
+	    sizeof(struct i2c_soil_record)) {
+	    return -EFAULT;
+	}
+	return sizeof(struct i2c_soil_record);
+    }
+    return retval;
+}
+
+/*
+ * Byte mode: return the sample p_file asked for, requesting it first
+ * if need be. Returns the sample value at p_file's resolution, or
+ * -ERRNO.
+ */
+static ssize_t i2c_soil_drv_read_sample(struct i2c_soil_file *p_file,
+					int nowait)
+{
+    struct i2c_soil_dev *p_dev = p_file->p_dev;
+    ktime_t deadline = i2c_soil_drv_deadline(p_file);
+    struct i2c_soil_sample stale;
+    ssize_t retval;
+
+    if ((retval = i2c_soil_drv_wait_ready(p_file, nowait, deadline))) {
+	goto wait_failed;
+    }
+
+    i2c_soil_drv_request_sample(p_file);
+
+    if (!i2c_soil_drv_sample_ready(p_file)) {
+	if (nowait) {
+	    return -EAGAIN;	/* Acquisition queued; poll says when */
+	}
+	/* Request stays pending for the retry (or after a stale read) */
+	if ((retval = i2c_soil_drv_wait_until(p_dev,
+					      i2c_soil_drv_sample_ready(p_file),
+					      deadline))) {
+	    goto wait_failed;
+	}
+    }
+
+    spin_lock(&p_dev->sample_lock);
+    retval = i2c_soil_drv_res_value(p_file,
+				    &p_dev->ring[p_dev->sample_seq & (I2C_SOIL_RING_LEN - 1)]);
+    p_file->seen_seq = p_dev->sample_seq;
+    p_file->req_pending = 0;
+    spin_unlock(&p_dev->sample_lock);
+
+    return retval;
+
+wait_failed:
+    if ((retval == -ETIME) &&
+	!(retval = i2c_soil_drv_last_good(p_file, &stale))) {
+	spin_lock(&p_dev->sample_lock);
+	retval = i2c_soil_drv_res_value(p_file, &stale);
+	spin_unlock(&p_dev->sample_lock);
+    }
+    return retval;
+}
+
+/*
+ * Returns negative on error, >=0 indicated # of bytes read.
+ *
+ * In the default byte mode, each read returns one fresh reading (or,
+ * with periodic sampling, the latest sample not yet returned on this
+ * file). In record mode (REC_ON_CMD), reads return buffered samples
+ * as struct i2c_soil_record, addressed by the file offset (see
+ * i2c_soil_drv_read_records), so the device can also be splice()d or
+ * sendfile()d straight into a pipe, socket or file.
+ *
+ * With per-file simulation on (FSIM_ON_CMD or I2C_SOIL_IOC_SET_FSIM),
+ * byte mode reads return the file's own simulated value at once.
+ *
+ * At 16-bit resolution (RES_RAW_CMD/RES_16_CMD or I2C_SOIL_IOC_SET_RES)
+ * byte mode reads return a native endian u16 rather than a byte.
+ *
+ * With a read deadline (I2C_SOIL_IOC_SET_DEADLINE), blocking reads
+ * that would wait past it return the last good sample instead.
+ *
+ * Blocking readers sleep until the acquisition completes.
+ * Non-blocking readers (O_NONBLOCK, or IOCB_NOWAIT from
+ * io_uring/preadv2) start the acquisition and get -EAGAIN; poll
+ * reports EPOLLIN once it is done and the next read returns it without
+ * touching the bus. io_uring uses exactly that sequence, so many
+ * devices can be read from one submission without a thread per fd.
+ */
+ssize_t i2c_soil_drv_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct i2c_soil_file *p_file = iocb->ki_filp->private_data;
+    struct i2c_soil_dev *p_i2c_soil_dev = p_file->p_dev;
+    int nowait = ((iocb->ki_flags & IOCB_NOWAIT) ||
+		  (iocb->ki_filp->f_flags & O_NONBLOCK));
+    size_t size = ((p_file->res == I2C_SOIL_RES_8BIT) ? 1 : sizeof(u16));
+    unsigned char moisture = 0;
+    u16 moisture16;
     ssize_t retval = 0;
 
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    PDEBUG("read %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
 
     /*
      * Soil moisture level is 0-255 (1 unsigned byte). Only read 1
      * byte. If user tries to read multiple bytes, that will result in
      * multiple calls to read. But reading >1 is really a user
-     * mistake, so there is no need to try to optimize for it.
+     * mistake, so there is no need to try to optimize for it. At
+     * 16-bit resolution the same goes for 2 bytes, and a 1 byte read
+     * can't hold the value.
      */
-    count = 1;
+    if (!iov_iter_count(to)) {
+	return 0;
+    }
+    if (READ_ONCE(p_i2c_soil_dev->removed)) {
+	return -ENODEV;
+    }
+    if (p_file->format == I2C_SOIL_FMT_REC) {
+	return i2c_soil_drv_read_records(iocb, to, nowait);
+    }
+    if (iov_iter_count(to) < size) {
+	return -EINVAL;
+    }
+
+    if (READ_ONCE(p_file->use_simulation)) {
+	/* Never touches the device */
+	struct i2c_soil_sample sim = {
+	    .val = READ_ONCE(p_file->sim_data),
+	    .raw = -1,
+	};
 
-    /* If simulation is on, return saved byte in dev struct */
-    if (p_i2c_soil_dev->use_simulation) {
-	/* Return previously write simulated data */
-	moisture = p_i2c_soil_dev->sim_data;
+	spin_lock(&p_i2c_soil_dev->sample_lock);
+	retval = i2c_soil_drv_res_value(p_file, &sim);
+	spin_unlock(&p_i2c_soil_dev->sample_lock);
     } else {
-	/* Do I2C read here */
-	retval = i2c_soil_drv_read_sensor(p_i2c_soil_dev->p_i2c_client);
-	if (retval < 0) {
-	    printk(KERN_WARNING "i2c-soil-drv: i2c_soil_drv_read_sensor FAILED, retval=%ld\n", retval);
-	    return retval;	/* Sensor read failed, bail out  */
-	} else {
-	    moisture = retval;	/* retval has valid read if >= 0 */
-	}
+	retval = i2c_soil_drv_read_sample(p_file, nowait);
+    }
+    if (retval < 0) {
+	return retval;		/* Sensor read failed, bail out  */
     }
+    moisture = retval;		/* retval has valid read if >= 0 */
+    moisture16 = retval;
 
-    /* moisture holds the value to return (simulated or real) */
-    /* copy_to_user returns number NOT copied, 0 on success. */
-    if (copy_to_user(buf, &moisture, count)) {
+    /* copy_to_iter returns number copied */
+    if (copy_to_iter((size == 1) ? (void *)&moisture : (void *)&moisture16,
+		     size, to) != size) {
 	retval = -EFAULT;
     } else {
-	retval = count;
+	retval = size;
     }
 
-    PDEBUG("1 byte read=0x%02x, sim mode %s", moisture,
-	   (p_i2c_soil_dev->use_simulation ? "on" : "off"));
-    PDEBUG("read: user buf = %p, retval = %ld", buf, retval);
+    PDEBUG("%zu byte read=0x%02lx, sim mode %s", size, (long)moisture16,
+	   (p_file->use_simulation ? "file" :
+	    (p_i2c_soil_dev->use_simulation ? "on" : "off")));
+    PDEBUG("read: retval = %ld", retval);
     return retval;
 }
 
+/*
+ * Readable once a requested acquisition has completed, or in record
+ * mode once the sample at the file offset exists, or once the probe a
+ * non-blocking read got -EAGAIN for has found the sensor. Writes never
+ * block.
+ */
+__poll_t i2c_soil_drv_poll(struct file *filp, poll_table *wait)
+{
+    struct i2c_soil_file *p_file = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    bool readable;
+
+    poll_wait(filp, &p_file->p_dev->sample_wq, wait);
+    if (p_file->format == I2C_SOIL_FMT_REC) {
+	s64 seq = i2c_soil_drv_pos_to_seq(READ_ONCE(filp->f_pos));
+
+	/* A misaligned offset makes read fail at once, so don't block */
+	readable = (seq < 0) || i2c_soil_drv_seq_ready(p_file->p_dev, seq);
+    } else {
+	readable = (READ_ONCE(p_file->use_simulation) ||
+		    i2c_soil_drv_sample_ready(p_file));
+    }
+    if (READ_ONCE(p_file->probe_wait) && !i2c_soil_probe_ready(p_file->p_dev)) {
+	readable = true;	/* The next read registers its request */
+    }
+    if (READ_ONCE(p_file->p_dev->removed)) {
+	mask |= EPOLLIN | EPOLLERR; /* Reads fail at once */
+    } else if (readable) {
+	mask |= EPOLLIN | EPOLLRDNORM;
+    } else if (!READ_ONCE(p_file->p_dev->use_simulation) &&
+	       (i2c_soil_probe_ready(p_file->p_dev) == -ENODEV)) {
+	mask |= EPOLLIN | EPOLLERR; /* Reads fail at once */
+    }
+    return mask;
+}
+
+/*
+ * Switch read format; any byte mode request in flight is dropped.
+ * Record mode starts at the first sample byte mode hasn't returned.
+ */
+static void i2c_soil_drv_set_format(struct i2c_soil_file *p_file, int format,
+				    loff_t *f_pos)
+{
+    spin_lock(&p_file->p_dev->sample_lock);
+    if ((format == I2C_SOIL_FMT_REC) && (p_file->format != format)) {
+	*f_pos = i2c_soil_drv_seq_to_pos(p_file->seen_seq + 1);
+	i2c_soil_drv_coalesce_reset(p_file, p_file->seen_seq + 1);
+    }
+    p_file->format = format;
+    p_file->req_pending = 0;
+    spin_unlock(&p_file->p_dev->sample_lock);
+}
+
+/*
+ * Switch read resolution. Taken under sample_lock, so a record batch
+ * or byte mode read is all at one resolution.
+ */
+static void i2c_soil_drv_set_res(struct i2c_soil_file *p_file, int res)
+{
+    spin_lock(&p_file->p_dev->sample_lock);
+    p_file->res = res;
+    spin_unlock(&p_file->p_dev->sample_lock);
+}
+
+/*
+ * Reader-lag coalescing on or off. Files on the list are visited each
+ * time a sample is overwritten, so it costs nothing for the others.
+ */
+static void i2c_soil_drv_set_coalesce(struct i2c_soil_file *p_file, int on)
+{
+    struct i2c_soil_dev *p_dev = p_file->p_dev;
+
+    spin_lock(&p_dev->sample_lock);
+    if (on && list_empty(&p_file->coalesce_node)) {
+	i2c_soil_drv_coalesce_reset(p_file, p_file->next_seq);
+	list_add_tail(&p_file->coalesce_node, &p_dev->coalesce_list);
+    } else if (!on) {
+	list_del_init(&p_file->coalesce_node);
+    }
+    spin_unlock(&p_dev->sample_lock);
+}
+
+/*
+ * Record mode seeks move between samples: SEEK_END is the next sample
+ * to be taken, so eg lseek(fd, -10 * sizeof(struct i2c_soil_record),
+ * SEEK_END) rewinds to the last 10. Offsets are only checked at read
+ * time. Byte mode reads ignore the offset, as they always have.
+ */
+loff_t i2c_soil_drv_llseek(struct file *filp, loff_t offset, int whence)
+{
+    struct i2c_soil_file *p_file = filp->private_data;
+    loff_t end;
+
+    if (p_file->format != I2C_SOIL_FMT_REC) {
+	return default_llseek(filp, offset, whence);
+    }
+    end = i2c_soil_drv_seq_to_pos(READ_ONCE(p_file->p_dev->sample_seq) + 1);
+    return generic_file_llseek_size(filp, offset, whence, MAX_LFS_FILESIZE, end);
+}
+
 /* Returns negative on error, >=0 indicated # of bytes read. */
 ssize_t i2c_soil_drv_write(struct file *filp, const char __user *buf,
 			   size_t count, loff_t *f_pos)
 {
     /* Probably safe to assume the kernel doesn't pass a null filp */
-    struct i2c_soil_dev *p_i2c_soil_dev = (struct i2c_soil_dev *) filp->private_data;
+    struct i2c_soil_file *p_file = (struct i2c_soil_file *) filp->private_data;
+    struct i2c_soil_dev *p_i2c_soil_dev = p_file->p_dev;
     ssize_t retval = count;
     char cmd_buf[MAX_CMD_BUF_SIZE];
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
 
+    if (READ_ONCE(p_i2c_soil_dev->removed)) {
+	return -ENODEV;
+    }
+
     /*
      * 4 possible cases, user has written:
      *  1. Single byte of simulated data
      *  2. SIM_ON_CMD (ie, "sim-on" without quotes)
      *  3. SIM_OFF_CMD (ie, "sim-off" without quotes)
-     *  4. Multi-byte write of other data (ignored)
+     *  4. REC_ON_CMD/REC_OFF_CMD, switch this file's read format
+     *  5. FSIM_ON_CMD/FSIM_OFF_CMD, per-file sim mode on or off
+     *  6. RES_8_CMD/RES_RAW_CMD/RES_16_CMD, this file's read resolution
+     *  7. COAL_ON_CMD/COAL_OFF_CMD, this file's reader-lag coalescing
+     *  8. Multi-byte write of other data (ignored)
      */
     if (1 == count) {		/* Case 1 */
-	if (p_i2c_soil_dev->use_simulation) {
+	if (p_file->use_simulation) {
+	    /* Per-file simulation; the device is left alone */
+	    if (copy_from_user(&(p_file->sim_data), buf, count)) {
+		retval = -EFAULT;
+	    }
+	    PDEBUG("1 byte write=0x%02x, file sim mode on", p_file->sim_data);
+	} else if (p_i2c_soil_dev->use_simulation) {
 	    /*
 	     * Soil moisture level is 0-255 (1 unsigned byte). Only
 	     * read 1 byte. If user tries to read multiple bytes,
@@ -247,7 +1177,7 @@ ssize_t i2c_soil_drv_write(struct file *filp, const char __user *buf,
 	    /* Do nothing - ignore single byte writes if simulation is off */
 	    PDEBUG("1 byte write ignored, sim mode off");
 	}
-    } else {		 /* Case 2, 3, or 4 */
+    } else {		 /* Case 2, 3, 4, 5, 6, 7 or 8 */
 	/* copy_from_user returns number NOT copied, 0 on success. */
 	/* min() to avoid buffer overrun on stack */
 	if (copy_from_user(cmd_buf, buf,
@@ -256,14 +1186,50 @@ ssize_t i2c_soil_drv_write(struct file *filp, const char __user *buf,
 	} else {
 	    /* Case 2 */
 	    if (!strncmp(cmd_buf,SIM_ON_CMD,strlen(SIM_ON_CMD))) {
-		p_i2c_soil_dev->use_simulation = 1;
+		i2c_soil_drv_set_sim(p_i2c_soil_dev, 1);
 		PDEBUG("sim mode enabled");
 	    } else if (!strncmp(cmd_buf,SIM_OFF_CMD,strlen(SIM_OFF_CMD))) {
 		/* Case 3 */
-		p_i2c_soil_dev->use_simulation = 0;
+		i2c_soil_drv_set_sim(p_i2c_soil_dev, 0);
 		PDEBUG("sim mode disabled");
+	    } else if (!strncmp(cmd_buf,REC_ON_CMD,strlen(REC_ON_CMD))) {
+		/* Case 4 */
+		i2c_soil_drv_set_format(p_file, I2C_SOIL_FMT_REC, f_pos);
+		PDEBUG("record mode enabled");
+	    } else if (!strncmp(cmd_buf,REC_OFF_CMD,strlen(REC_OFF_CMD))) {
+		/* Case 4 */
+		i2c_soil_drv_set_format(p_file, I2C_SOIL_FMT_BYTE, f_pos);
+		PDEBUG("record mode disabled");
+	    } else if (!strncmp(cmd_buf,FSIM_ON_CMD,strlen(FSIM_ON_CMD))) {
+		/* Case 5 */
+		WRITE_ONCE(p_file->use_simulation, 1);
+		PDEBUG("file sim mode enabled");
+	    } else if (!strncmp(cmd_buf,FSIM_OFF_CMD,strlen(FSIM_OFF_CMD))) {
+		/* Case 5 */
+		WRITE_ONCE(p_file->use_simulation, 0);
+		PDEBUG("file sim mode disabled");
+	    } else if (!strncmp(cmd_buf,RES_8_CMD,strlen(RES_8_CMD))) {
+		/* Case 6 */
+		i2c_soil_drv_set_res(p_file, I2C_SOIL_RES_8BIT);
+		PDEBUG("8-bit resolution");
+	    } else if (!strncmp(cmd_buf,RES_RAW_CMD,strlen(RES_RAW_CMD))) {
+		/* Case 6 */
+		i2c_soil_drv_set_res(p_file, I2C_SOIL_RES_RAW);
+		PDEBUG("raw resolution");
+	    } else if (!strncmp(cmd_buf,RES_16_CMD,strlen(RES_16_CMD))) {
+		/* Case 6 */
+		i2c_soil_drv_set_res(p_file, I2C_SOIL_RES_SCALED);
+		PDEBUG("16-bit scaled resolution");
+	    } else if (!strncmp(cmd_buf,COAL_ON_CMD,strlen(COAL_ON_CMD))) {
+		/* Case 7 */
+		i2c_soil_drv_set_coalesce(p_file, 1);
+		PDEBUG("coalescing enabled");
+	    } else if (!strncmp(cmd_buf,COAL_OFF_CMD,strlen(COAL_OFF_CMD))) {
+		/* Case 7 */
+		i2c_soil_drv_set_coalesce(p_file, 0);
+		PDEBUG("coalescing disabled");
 	    } else {
-		/* Case 4 - write data is unknown, ignore */
+		/* Case 8 - write data is unknown, ignore */
 		cmd_buf[MAX_CMD_BUF_SIZE-1] = 0; /* Force null term */
 		PDEBUG("Unexpected multi-byte write, data=%s",cmd_buf);
 	    }
@@ -274,24 +1240,282 @@ ssize_t i2c_soil_drv_write(struct file *filp, const char __user *buf,
     return retval;
 }
 
+/*
+ * ioctl equivalents of the in-band commands, for programs that would
+ * rather not parse strings. Returns 0 or -ERRNO.
+ */
+long i2c_soil_drv_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct i2c_soil_file *p_file = filp->private_data;
+    struct i2c_soil_fsim fsim;
+    struct i2c_soil_deadline deadline;
+    struct i2c_soil_replay replay;
+    u32 res;
+
+    if (READ_ONCE(p_file->p_dev->removed)) {
+	return -ENODEV;
+    }
+
+    switch (cmd) {
+    case I2C_SOIL_IOC_SET_FSIM:
+	if (copy_from_user(&fsim, (void __user *)arg, sizeof(fsim))) {
+	    return -EFAULT;
+	}
+	if ((fsim.enable > 1) || (fsim.data > I2C_MAX_WET_READING)) {
+	    return -EINVAL;
+	}
+	WRITE_ONCE(p_file->sim_data, fsim.data);
+	WRITE_ONCE(p_file->use_simulation, fsim.enable);
+	return 0;
+    case I2C_SOIL_IOC_GET_FSIM:
+	memset(&fsim, 0, sizeof(fsim));
+	fsim.enable = READ_ONCE(p_file->use_simulation);
+	fsim.data = READ_ONCE(p_file->sim_data);
+	if (copy_to_user((void __user *)arg, &fsim, sizeof(fsim))) {
+	    return -EFAULT;
+	}
+	return 0;
+    case I2C_SOIL_IOC_SET_DEADLINE:
+	if (copy_from_user(&deadline, (void __user *)arg, sizeof(deadline))) {
+	    return -EFAULT;
+	}
+	WRITE_ONCE(p_file->deadline_us, deadline.timeout_us);
+	return 0;
+    case I2C_SOIL_IOC_GET_DEADLINE:
+	memset(&deadline, 0, sizeof(deadline));
+	deadline.timeout_us = READ_ONCE(p_file->deadline_us);
+	spin_lock(&p_file->p_dev->sample_lock);
+	deadline.stale_reads = p_file->stale_reads;
+	spin_unlock(&p_file->p_dev->sample_lock);
+	if (copy_to_user((void __user *)arg, &deadline, sizeof(deadline))) {
+	    return -EFAULT;
+	}
+	return 0;
+    case I2C_SOIL_IOC_SET_RES:
+	if (get_user(res, (u32 __user *)arg)) {
+	    return -EFAULT;
+	}
+	if (res > I2C_SOIL_RES_SCALED) {
+	    return -EINVAL;
+	}
+	i2c_soil_drv_set_res(p_file, res);
+	return 0;
+    case I2C_SOIL_IOC_GET_RES:
+	return put_user((u32)READ_ONCE(p_file->res), (u32 __user *)arg);
+    case I2C_SOIL_IOC_REPLAY:
+	if (copy_from_user(&replay, (void __user *)arg, sizeof(replay))) {
+	    return -EFAULT;
+	}
+	return i2c_soil_replay_start(p_file->p_dev, &replay);
+    default:
+	return -ENOTTY;
+    }
+}
+
 struct file_operations i2c_soil_drv_fops = {
     .owner          = THIS_MODULE,
-    .read           = i2c_soil_drv_read,
+    .llseek         = i2c_soil_drv_llseek,
+    .read_iter      = i2c_soil_drv_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read    = copy_splice_read,
+#else
+    .splice_read    = generic_file_splice_read,
+#endif
     .write          = i2c_soil_drv_write,
+    .poll           = i2c_soil_drv_poll,
+    .unlocked_ioctl = i2c_soil_drv_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
     .open           = i2c_soil_drv_open,
     .release        = i2c_soil_drv_release,
 };
 
+static void i2c_soil_drv_dev_release(struct device *dev)
+{
+    kfree(container_of(dev, struct i2c_soil_dev, dev));
+}
+
+/*
+ * Allocate sensor number index (minor number index) with default
+ * settings, not yet attached to a bus or registered. Once this
+ * succeeds, put_device frees it. Returns the new device or ERR_PTR.
+ */
+struct i2c_soil_dev *i2c_soil_drv_alloc_dev(int index)
+{
+    struct i2c_soil_dev *p_dev;
+    int retval;
+
+    /* Zeroed - this will default simulation mode to off. */
+    p_dev = kzalloc(sizeof(struct i2c_soil_dev), GFP_KERNEL);
+    if (!p_dev) {
+	return ERR_PTR(-ENOMEM);
+    }
+
+    p_dev->index = index;
+    p_dev->sample_period_ms = sample_period_ms;
+    p_dev->conv_delay_us = I2C_MSEC_DELAY * USEC_PER_MSEC;
+    p_dev->max_rereads = I2C_MAX_REREADS;
+    p_dev->filter_depth = 1;
+    p_dev->prefetch = 1;
+    p_dev->raw_dry = I2C_MIN_RAW_DRY_READING;
+    p_dev->raw_wet = I2C_MAX_RAW_WET_READING;
+    mutex_init(&p_dev->config_lock);
+    spin_lock_init(&p_dev->sample_lock);
+    init_waitqueue_head(&p_dev->sample_wq);
+    INIT_LIST_HEAD(&p_dev->coalesce_list);
+    i2c_soil_sched_init(p_dev);
+    i2c_soil_burst_init(p_dev);
+    i2c_soil_bench_init(p_dev);
+    i2c_soil_replay_init(p_dev);
+    i2c_soil_probe_init(p_dev);
+    i2c_soil_pump_init(p_dev);
+
+    /* From here on, put_device frees p_dev via i2c_soil_drv_dev_release */
+    device_initialize(&p_dev->dev);
+    p_dev->dev.class = &i2c_soil_class;
+    p_dev->dev.devt = MKDEV(i2c_soil_dev_major, i2c_soil_dev_minor + index);
+    p_dev->dev.release = i2c_soil_drv_dev_release;
+    p_dev->dev.groups = i2c_soil_dev_groups;
+    /* Sensor 0 keeps the original node name, /dev/i2c-soil-drv */
+    if (index) {
+	retval = dev_set_name(&p_dev->dev, "i2c-soil-drv%d", index);
+    } else {
+	retval = dev_set_name(&p_dev->dev, "i2c-soil-drv");
+    }
+    if (retval) {
+	put_device(&p_dev->dev);
+	return ERR_PTR(retval);
+    }
+
+    return p_dev;
+}
+
+/* Make an allocated, attached sensor visible to userspace */
+int i2c_soil_drv_add_dev(struct i2c_soil_dev *p_dev)
+{
+    cdev_init(&p_dev->cdev, &i2c_soil_drv_fops);
+    p_dev->cdev.owner = THIS_MODULE;
+
+    /* Sensor is "live" after successful cdev_device_add call */
+    return cdev_device_add(&p_dev->cdev, &p_dev->dev);
+}
+
+/*
+ * Allocate and register sensor number index (minor number index) on
+ * adapter bus_num at i2c address addr. The node appears at once, but
+ * stays not-ready until the asynchronous probe (see probe.c) has found
+ * the sensor, which also starts periodic sampling. Returns the new
+ * device or ERR_PTR.
+ */
+static struct i2c_soil_dev *i2c_soil_drv_create_dev(int index, int bus_num,
+						    int addr)
+{
+    struct i2c_soil_dev *p_dev;
+    int retval;
+
+    p_dev = i2c_soil_drv_alloc_dev(index);
+    if (IS_ERR(p_dev)) {
+	return p_dev;
+    }
+    p_dev->bus_num = bus_num;
+    p_dev->addr = addr;
+
+    if ((index == pump_sensor) && (pump_gpio >= 0) &&
+	((retval = i2c_soil_pump_attach(p_dev, pump_chip, pump_gpio)) < 0)) {
+	put_device(&p_dev->dev);
+	return ERR_PTR(retval);
+    }
+
+    if ((retval = i2c_soil_drv_add_dev(p_dev)) < 0 ) {
+	printk(KERN_WARNING "i2c-soil-drv: cdev_device_add failed\n");
+	i2c_soil_pump_detach(p_dev);
+	put_device(&p_dev->dev);
+	return ERR_PTR(retval);
+    }
+
+    i2c_soil_probe_start(p_dev);
+    return p_dev;
+}
+
+/* True if sensor bus_num-addr is set by the i2c_buses/i2c_addrs parameters */
+bool i2c_soil_drv_configured(int bus_num, int addr)
+{
+    for (int i = 0; i < num_i2c_buses; i++) {
+	if ((i2c_buses[i] == bus_num) &&
+	    (((i < num_i2c_addrs) ? i2c_addrs[i] : I2C_BUS_ADDR) == addr)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+/*
+ * Add a sensor found by scanning, with the next free sensor number.
+ * Returns 0 or -ERRNO.
+ */
+int i2c_soil_drv_add_sensor(int bus_num, int addr)
+{
+    struct i2c_soil_dev *p_dev;
+    int retval = 0;
+
+    mutex_lock(&i2c_soil_devices_lock);
+    if (i2c_soil_num_devs >= ARRAY_SIZE(i2c_soil_devices)) {
+	printk(KERN_WARNING "i2c-soil-drv: no room for sensor at %d-%04x\n",
+	       bus_num, addr);
+	retval = -ENOSPC;
+    } else {
+	p_dev = i2c_soil_drv_create_dev(i2c_soil_num_devs, bus_num, addr);
+	if (IS_ERR(p_dev)) {
+	    retval = PTR_ERR(p_dev);
+	} else {
+	    i2c_soil_devices[i2c_soil_num_devs++] = p_dev;
+	}
+    }
+    mutex_unlock(&i2c_soil_devices_lock);
+    return retval;
+}
+
+/*
+ * Also used for virtual sensors, which have no i2c client. Those can
+ * be removed (rmdir) with files still open, which keep p_dev until
+ * closed; removed makes their reads, writes and ioctls fail -ENODEV
+ * from here on, so nothing new (a replay, say) starts after cleanup,
+ * and blocked readers are woken to fail rather than wait forever.
+ */
+void i2c_soil_drv_destroy_dev(struct i2c_soil_dev *p_dev)
+{
+    WRITE_ONCE(p_dev->removed, 1);
+    wake_up_interruptible_poll(&p_dev->sample_wq, EPOLLIN | EPOLLERR);
+
+    /* Order is reverse of i2c_soil_drv_create_dev */
+    cdev_device_del(&p_dev->cdev, &p_dev->dev);
+    i2c_soil_probe_stop(p_dev);
+    i2c_soil_sched_stop(p_dev);
+    i2c_soil_burst_cleanup(p_dev);
+    i2c_soil_bench_cleanup(p_dev);
+    i2c_soil_replay_cleanup(p_dev);
+    i2c_soil_pump_detach(p_dev);
+    i2c_unregister_device(p_dev->p_i2c_client);
+    put_device(&p_dev->dev);
+}
+
 static int i2c_soil_drv_init(void)
 {
     dev_t devnum = 0;
     int retval;
+    struct i2c_soil_dev *p_dev;
 
     PDEBUG("i2c_soil_drv_init\n");
 
+    /* Check parameters before taking anything that would need undoing */
+    if ((i2c_soil_rt_cpu >= 0) &&
+	((i2c_soil_rt_cpu >= nr_cpu_ids) || !cpu_online(i2c_soil_rt_cpu))) {
+	printk(KERN_WARNING "i2c-soil-drv: rt_cpu %d is not online\n", i2c_soil_rt_cpu);
+	return -EINVAL;
+    }
+
     /* Devnum is output-only, per LDD chpt 3 */
     /* Don't put call in if; want to save major num before test for cleanup */
-    retval = alloc_chrdev_region(&devnum, i2c_soil_dev_minor, NUM_MINORS,
+    retval = alloc_chrdev_region(&devnum, i2c_soil_dev_minor, I2C_SOIL_MAX_MINORS,
 				 "i2c-soil-drv");
     i2c_soil_dev_major = MAJOR(devnum);
     if (retval < 0 ) {
@@ -299,49 +1523,71 @@ static int i2c_soil_drv_init(void)
 	goto alloc_chrdev_region_failed;
     }
 
-    /* Zero out soil dev - this will default simulation mode to off. */
-    memset(&i2c_soil_device, 0, sizeof(struct i2c_soil_dev));
+    if ((retval = class_register(&i2c_soil_class)) < 0) {
+	printk(KERN_WARNING "i2c-soil-drv: class_register failed\n");
+	goto class_register_failed;
+    }
 
-    cdev_init(&i2c_soil_device.cdev, &i2c_soil_drv_fops);
-    i2c_soil_device.cdev.owner = THIS_MODULE;
-    /* Why doesn't cdev_init set cedv.ops? */
-    i2c_soil_device.cdev.ops   = &i2c_soil_drv_fops;
+    /* Sensors publish over netlink from their first sample on */
+    if ((retval = i2c_soil_nl_init()) < 0) {
+	printk(KERN_WARNING "i2c-soil-drv: genl_register_family failed\n");
+	goto nl_init_failed;
+    }
 
-    i2c_soil_device.p_i2c_adapter = i2c_get_adapter(I2C_BUS_NUM);
-    /* Looking at i2c-core-base.c, returns NULL on error */
-    if (!(i2c_soil_device.p_i2c_adapter)) {
-	printk(KERN_WARNING "i2c-soil-drv: i2c_get_adapter failed\n");
-	retval = -ENOMEM;	/* Guess... */
-	goto i2c_get_adapter_failed;
+    for (int i = 0; i < num_i2c_buses; i++) {
+	p_dev = i2c_soil_drv_create_dev(i, i2c_buses[i],
+					((i < num_i2c_addrs) ?
+					 i2c_addrs[i] : I2C_BUS_ADDR));
+	if (IS_ERR(p_dev)) {
+	    retval = PTR_ERR(p_dev);
+	    goto create_dev_failed;
+	}
+	i2c_soil_devices[i2c_soil_num_devs++] = p_dev;
+	PDEBUG("sensor %d: bus %d, major=%d, minor=%d, p_dev=%p\n", i,
+	       i2c_buses[i], MAJOR(devnum), MINOR(devnum) + i, p_dev);
     }
 
-    i2c_soil_device.p_i2c_client =
-	i2c_new_dummy_device(i2c_soil_device.p_i2c_adapter, I2C_BUS_ADDR);
-    /* see LDD3, pg 295 - ERR_PTR/IS_ERR/PTR_ERR */
-    if (IS_ERR(i2c_soil_device.p_i2c_client)) {
-	printk(KERN_WARNING "i2c-soil-drv: i2c_new_dummy_device failed\n");
-	retval = PTR_ERR(i2c_soil_device.p_i2c_client);
-	goto i2c_new_dummy_failed;
+    /* Found sensors take the numbers after the configured ones */
+    if ((i2c_soil_scan_addr_min < 0x08) || (i2c_soil_scan_addr_max > 0x77) ||
+	(i2c_soil_scan_addr_min > i2c_soil_scan_addr_max)) {
+	printk(KERN_WARNING "i2c-soil-drv: bad scan range 0x%02x-0x%02x\n",
+	       i2c_soil_scan_addr_min, i2c_soil_scan_addr_max);
+	retval = -EINVAL;
+	goto create_dev_failed;
     }
+    for (int i = 0; i < num_scan_buses; i++) {
+	bool dup = false;
 
-    if ((retval = cdev_add(&i2c_soil_device.cdev, devnum, NUM_MINORS)) < 0 ) {
-	printk(KERN_WARNING "i2c-soil-drv: cdev_add failed\n");
-	goto cdev_add_failed;
+	for (int j = 0; j < i; j++) {
+	    dup |= (scan_buses[j] == scan_buses[i]);
+	}
+	if (!dup) {
+	    i2c_soil_probe_scan(scan_buses[i]);
+	}
     }
 
-    /* Driver is "live" after successful cdev_add call */
+    i2c_soil_debugfs_init();
 
-    PDEBUG("i2c_soil_drv_init, major=%d, minor=%d, &i2c_soil_device=%p, p_i2c_adapter=%p\n",
-	   MAJOR(devnum), MINOR(devnum), &i2c_soil_device,
-	   i2c_soil_device.p_i2c_adapter);
+    /* Virtual sensors can be created from here on */
+    if ((retval = i2c_soil_vsensor_init()) < 0) {
+	printk(KERN_WARNING "i2c-soil-drv: configfs_register_subsystem failed\n");
+	goto vsensor_init_failed;
+    }
     return 0;
 
-cdev_add_failed:
-    i2c_unregister_device(i2c_soil_device.p_i2c_client);
-i2c_new_dummy_failed:
-    /* Is there an adapter release (opposite of i2c_get_adapter)? */
-i2c_get_adapter_failed:
-    unregister_chrdev_region(devnum, NUM_MINORS);
+vsensor_init_failed:
+    i2c_soil_debugfs_cleanup();
+create_dev_failed:
+    i2c_soil_probe_sync();
+    while (i2c_soil_num_devs > 0) {
+	i2c_soil_drv_destroy_dev(i2c_soil_devices[--i2c_soil_num_devs]);
+    }
+    i2c_soil_bus_put_all();
+    i2c_soil_nl_cleanup();
+nl_init_failed:
+    class_unregister(&i2c_soil_class);
+class_register_failed:
+    unregister_chrdev_region(devnum, I2C_SOIL_MAX_MINORS);
 alloc_chrdev_region_failed:
     return retval;
 }
@@ -353,11 +1599,22 @@ static void i2c_soil_drv_cleanup(void)
     PDEBUG("i2c_soil_drv_cleanup\n");
 
     /* Order is reverse of i2c_soil_drv_init */
-    cdev_del(&i2c_soil_device.cdev);
-    i2c_unregister_device(i2c_soil_device.p_i2c_client);
-    /* Is there an adapter release (opposite of i2c_get_adapter)? */
-    unregister_chrdev_region(devnum, NUM_MINORS);
+    i2c_soil_vsensor_cleanup();
+    i2c_soil_debugfs_cleanup();
+    i2c_soil_probe_sync();
+    while (i2c_soil_num_devs > 0) {
+	i2c_soil_drv_destroy_dev(i2c_soil_devices[--i2c_soil_num_devs]);
+    }
+    i2c_soil_bus_put_all();
+    i2c_soil_nl_cleanup();
+    class_unregister(&i2c_soil_class);
+    unregister_chrdev_region(devnum, I2C_SOIL_MAX_MINORS);
 }
 
 module_init(i2c_soil_drv_init)
 module_exit(i2c_soil_drv_cleanup)
+
+/* Tests use the static helpers above, so are built as part of this file */
+#ifdef I2C_SOIL_DRV_KUNIT
+#include "i2c-soil-drv-kunit.c"
+#endif
@@ -0,0 +1,128 @@
+/**************************************************************************
+ *
+ * netlink.c
+ *
+ * Generic netlink multicast of samples for the i2c soil moisture
+ * driver. Every sample from every sensor goes to the "samples" group,
+ * and threshold crossings also go to the "events" group, so any number
+ * of local listeners can follow all sensors with one socket each.
+ *
+ * Each message costs one multicast regardless of the number of
+ * listeners, and nothing at all when there are none.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <net/genetlink.h>
+
+#include "i2c-soil-drv-int.h"
+
+/* Multicast group indices within the family */
+enum {
+    I2C_SOIL_NL_GRP_SAMPLES,
+    I2C_SOIL_NL_GRP_EVENTS,
+};
+
+static const struct genl_multicast_group i2c_soil_nl_mcgrps[] = {
+    [I2C_SOIL_NL_GRP_SAMPLES] = { .name = I2C_SOIL_NL_MCGRP_SAMPLES },
+    [I2C_SOIL_NL_GRP_EVENTS] = { .name = I2C_SOIL_NL_MCGRP_EVENTS },
+};
+
+/* Multicast only, so no ops */
+static struct genl_family i2c_soil_nl_family = {
+    .name = I2C_SOIL_NL_FAMILY_NAME,
+    .version = I2C_SOIL_NL_VERSION,
+    .maxattr = I2C_SOIL_NL_A_MAX,
+    .module = THIS_MODULE,
+    .mcgrps = i2c_soil_nl_mcgrps,
+    .n_mcgrps = ARRAY_SIZE(i2c_soil_nl_mcgrps),
+};
+
+int i2c_soil_nl_init(void)
+{
+    return genl_register_family(&i2c_soil_nl_family);
+}
+
+void i2c_soil_nl_cleanup(void)
+{
+    genl_unregister_family(&i2c_soil_nl_family);
+}
+
+/*
+ * Build and multicast one cmd message for p_sample to group.
+ * Delivery is best effort, like any netlink multicast; a listener that
+ * can't keep up sees ENOBUFS on its socket.
+ */
+static void i2c_soil_nl_send(struct i2c_soil_dev *p_dev,
+			     const struct i2c_soil_sample *p_sample,
+			     int cmd, int group, int thresh_state)
+{
+    struct sk_buff *skb;
+    void *hdr;
+
+    skb = genlmsg_new(nla_total_size(sizeof(u32)) * 3 +
+		      nla_total_size_64bit(sizeof(u64)) +
+		      nla_total_size(sizeof(u16)) +
+		      nla_total_size(sizeof(u8)) * 2, GFP_KERNEL);
+    if (!skb) {
+	return;
+    }
+
+    hdr = genlmsg_put(skb, 0, 0, &i2c_soil_nl_family, 0, cmd);
+    if (!hdr) {
+	goto nla_put_failed;
+    }
+
+    if (nla_put_u32(skb, I2C_SOIL_NL_A_DEV, p_dev->index) ||
+	nla_put_u32(skb, I2C_SOIL_NL_A_SEQ, p_sample->seq) ||
+	nla_put_u64_64bit(skb, I2C_SOIL_NL_A_TIMESTAMP,
+			  ktime_to_ns(p_sample->timestamp), I2C_SOIL_NL_A_PAD)) {
+	goto nla_put_failed;
+    }
+    if (p_sample->val < 0) {
+	if (nla_put_s32(skb, I2C_SOIL_NL_A_ERROR, p_sample->val)) {
+	    goto nla_put_failed;
+	}
+    } else if (nla_put_u8(skb, I2C_SOIL_NL_A_VALUE, p_sample->val) ||
+	       ((p_sample->raw >= 0) &&
+		nla_put_u16(skb, I2C_SOIL_NL_A_RAW, p_sample->raw))) {
+	goto nla_put_failed;
+    }
+    if ((cmd == I2C_SOIL_NL_CMD_THRESHOLD) &&
+	nla_put_u8(skb, I2C_SOIL_NL_A_THRESHOLD, thresh_state)) {
+	goto nla_put_failed;
+    }
+
+    genlmsg_end(skb, hdr);
+    genlmsg_multicast(&i2c_soil_nl_family, skb, 0, group, GFP_KERNEL);
+    return;
+
+nla_put_failed:
+    nlmsg_free(skb);
+}
+
+void i2c_soil_nl_sample(struct i2c_soil_dev *p_dev,
+			const struct i2c_soil_sample *p_sample)
+{
+    if (genl_has_listeners(&i2c_soil_nl_family, &init_net,
+			   I2C_SOIL_NL_GRP_SAMPLES)) {
+	i2c_soil_nl_send(p_dev, p_sample, I2C_SOIL_NL_CMD_SAMPLE,
+			 I2C_SOIL_NL_GRP_SAMPLES, 0);
+    }
+}
+
+void i2c_soil_nl_threshold(struct i2c_soil_dev *p_dev,
+			   const struct i2c_soil_sample *p_sample,
+			   int thresh_state)
+{
+    if (genl_has_listeners(&i2c_soil_nl_family, &init_net,
+			   I2C_SOIL_NL_GRP_EVENTS)) {
+	i2c_soil_nl_send(p_dev, p_sample, I2C_SOIL_NL_CMD_THRESHOLD,
+			 I2C_SOIL_NL_GRP_EVENTS, thresh_state);
+    }
+}
@@ -0,0 +1,261 @@
+/**************************************************************************
+ *
+ * probe.c
+ *
+ * Asynchronous sensor probe for the i2c soil moisture driver, so that
+ * insmod (and boot) never waits on slow or absent i2c devices.
+ *
+ * Each sensor's device node is created straight away, not-ready. An
+ * async thread then attaches it to its adapter, and the bus worker
+ * verifies it by reading the seesaw HW_ID, retrying for sensors that
+ * are still powering up. Once verified the sensor is ready and
+ * periodic sampling starts; until then reads of the real sensor wait
+ * (or get -EAGAIN), and if it is never found they fail with -ENODEV.
+ * Simulation works regardless.
+ *
+ * Adapters listed in the scan_buses module parameter are also scanned
+ * for more sensors, all adapters in parallel. Addresses no other
+ * driver has claimed that answer with a seesaw HW_ID become sensors
+ * too, after the configured ones.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/async.h>
+#include <linux/poll.h>
+
+#include "i2c-soil-drv-int.h"
+
+/* Only our probes and scans, so unload doesn't wait for unrelated async work */
+static ASYNC_DOMAIN_EXCLUSIVE(i2c_soil_probe_domain);
+
+/*
+ * Read the seesaw HW_ID register of whatever is at addr on p_adapter:
+ * same write-then-read sequence as a moisture reading. An empty
+ * address NAKs the write straight away. Call on the adapter's bus
+ * worker, with addr claimed. Returns the id or -ERRNO.
+ */
+int i2c_soil_probe_hw_id(struct i2c_adapter *p_adapter, u16 addr)
+{
+    u8 i2c_buf[2];
+    struct i2c_msg msg = {
+	.addr = addr,
+	.buf = i2c_buf,
+    };
+    int retval;
+
+    i2c_buf[0] = I2C_STATUS_BASE_ADDR;
+    i2c_buf[1] = I2C_STATUS_HW_ID;
+    msg.len = sizeof(i2c_buf);
+    retval = i2c_transfer(p_adapter, &msg, 1);
+    if (retval < 0) {
+	return retval;
+    } else if (1 != retval) {
+	return -EIO;
+    }
+
+    fsleep(I2C_SOIL_HW_ID_DELAY_US);
+
+    msg.flags = I2C_M_RD;
+    msg.len = 1;
+    retval = i2c_transfer(p_adapter, &msg, 1);
+    if (retval < 0) {
+	return retval;
+    } else if (1 != retval) {
+	return -EIO;
+    }
+    return i2c_buf[0];
+}
+
+bool i2c_soil_probe_hw_id_ok(int hw_id)
+{
+    return (hw_id == I2C_HW_ID_SAMD09) ||
+	((hw_id >= I2C_HW_ID_TINY8X7_MIN) && (hw_id <= I2C_HW_ID_TINY8X7_MAX));
+}
+
+/* Publish the probe result and wake readers waiting on it */
+static void i2c_soil_probe_set_state(struct i2c_soil_dev *p_dev, int state)
+{
+    /* p_bus and p_i2c_client are visible before the state says ready */
+    smp_store_release(&p_dev->probe_state, state);
+    wake_up_interruptible_poll(&p_dev->sample_wq, EPOLLIN | EPOLLRDNORM);
+}
+
+/*
+ * Verify the sensor on its bus worker, like any other transaction.
+ * Retries are requeued rather than slept, so other sensors on the bus
+ * keep being probed and sampled in between.
+ */
+static void i2c_soil_probe_work(struct kthread_work *work)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(work, struct i2c_soil_dev, probe_work.work);
+    int hw_id;
+
+    hw_id = i2c_soil_probe_hw_id(p_dev->p_i2c_client->adapter, p_dev->addr);
+    if ((hw_id >= 0) && i2c_soil_probe_hw_id_ok(hw_id)) {
+	printk(KERN_INFO "i2c-soil-drv: sensor %d: hw id 0x%02x at %d-%04x\n",
+	       p_dev->index, hw_id, p_dev->bus_num, p_dev->addr);
+	p_dev->hw_id = hw_id;
+
+	/* Sampling starts with whatever period sysfs set meanwhile */
+	mutex_lock(&p_dev->config_lock);
+	i2c_soil_probe_set_state(p_dev, I2C_SOIL_PROBE_READY);
+	i2c_soil_sched_start(p_dev);
+	mutex_unlock(&p_dev->config_lock);
+	return;
+    }
+
+    if (++p_dev->probe_tries < I2C_SOIL_PROBE_TRIES) {
+	kthread_queue_delayed_work(p_dev->p_bus->p_worker, &p_dev->probe_work,
+				   msecs_to_jiffies(I2C_SOIL_PROBE_RETRY_MS));
+	return;
+    }
+
+    if (hw_id >= 0) {
+	printk(KERN_WARNING "i2c-soil-drv: sensor %d: unexpected hw id 0x%02x at %d-%04x\n",
+	       p_dev->index, hw_id, p_dev->bus_num, p_dev->addr);
+    } else {
+	printk(KERN_WARNING "i2c-soil-drv: sensor %d: no response at %d-%04x, retval=%d\n",
+	       p_dev->index, p_dev->bus_num, p_dev->addr, hw_id);
+    }
+    i2c_soil_probe_set_state(p_dev, I2C_SOIL_PROBE_ABSENT);
+}
+
+/* Attach to the adapter, then hand over to the bus worker to verify */
+static void i2c_soil_probe_async(void *data, async_cookie_t cookie)
+{
+    struct i2c_soil_dev *p_dev = data;
+    struct i2c_soil_bus *p_bus;
+    struct i2c_client *p_i2c_client;
+
+    p_bus = i2c_soil_bus_get(p_dev->bus_num);
+    if (IS_ERR(p_bus)) {
+	i2c_soil_probe_set_state(p_dev, I2C_SOIL_PROBE_ABSENT);
+	return;
+    }
+
+    p_i2c_client = i2c_new_dummy_device(p_bus->p_i2c_adapter, p_dev->addr);
+    /* see LDD3, pg 295 - ERR_PTR/IS_ERR/PTR_ERR */
+    if (IS_ERR(p_i2c_client)) {
+	printk(KERN_WARNING "i2c-soil-drv: i2c_new_dummy_device(%d, 0x%02x) failed\n",
+	       p_dev->bus_num, p_dev->addr);
+	i2c_soil_probe_set_state(p_dev, I2C_SOIL_PROBE_ABSENT);
+	return;
+    }
+
+    p_dev->p_bus = p_bus;
+    p_dev->bus_slot = i2c_soil_bus_add_dev(p_bus);
+    p_dev->p_i2c_client = p_i2c_client;
+    kthread_queue_delayed_work(p_bus->p_worker, &p_dev->probe_work, 0);
+}
+
+void i2c_soil_probe_init(struct i2c_soil_dev *p_dev)
+{
+    kthread_init_delayed_work(&p_dev->probe_work, i2c_soil_probe_work);
+}
+
+void i2c_soil_probe_start(struct i2c_soil_dev *p_dev)
+{
+    async_schedule_domain(i2c_soil_probe_async, p_dev, &i2c_soil_probe_domain);
+}
+
+/* Stop verification retries; call after i2c_soil_probe_sync */
+void i2c_soil_probe_stop(struct i2c_soil_dev *p_dev)
+{
+    kthread_cancel_delayed_work_sync(&p_dev->probe_work);
+}
+
+/* Wait for all attach threads, so none outlives the devices */
+void i2c_soil_probe_sync(void)
+{
+    async_synchronize_full_domain(&i2c_soil_probe_domain);
+}
+
+/* One scan candidate's HW_ID read, run on the bus worker */
+struct i2c_soil_scan_work
+{
+    struct kthread_work work;
+    struct i2c_client *p_i2c_client; /* Claims the candidate address */
+    int hw_id;
+};
+
+static void i2c_soil_probe_scan_work(struct kthread_work *work)
+{
+    struct i2c_soil_scan_work *p_scan =
+	container_of(work, struct i2c_soil_scan_work, work);
+
+    p_scan->hw_id = i2c_soil_probe_hw_id(p_scan->p_i2c_client->adapter,
+					 p_scan->p_i2c_client->addr);
+}
+
+/*
+ * Scan one adapter, data (the bus number), over the scan address
+ * range. Each candidate address is claimed with a dummy client first,
+ * so addresses another driver owns (where that fails) are never
+ * written to, and the HW_ID read runs on the adapter's bus worker like
+ * every other transaction.
+ */
+static void i2c_soil_probe_scan_async(void *data, async_cookie_t cookie)
+{
+    int bus_num = (long)data;
+    struct i2c_soil_bus *p_bus;
+    struct i2c_soil_scan_work scan;
+    int found = 0;
+
+    p_bus = i2c_soil_bus_get(bus_num);
+    if (IS_ERR(p_bus)) {
+	printk(KERN_WARNING "i2c-soil-drv: scan: can't use i2c adapter %d, retval=%ld\n",
+	       bus_num, PTR_ERR(p_bus));
+	return;
+    }
+
+    for (int addr = i2c_soil_scan_addr_min; addr <= i2c_soil_scan_addr_max; addr++) {
+	if (i2c_soil_drv_configured(bus_num, addr)) {
+	    continue;		/* Probed as a configured sensor */
+	}
+	scan.p_i2c_client = i2c_new_dummy_device(p_bus->p_i2c_adapter, addr);
+	if (IS_ERR(scan.p_i2c_client)) {
+	    continue;		/* Busy, another driver's device */
+	}
+	kthread_init_work(&scan.work, i2c_soil_probe_scan_work);
+	kthread_queue_work(p_bus->p_worker, &scan.work);
+	kthread_flush_work(&scan.work);
+	/* The sensor attaches its own client, see i2c_soil_probe_async */
+	i2c_unregister_device(scan.p_i2c_client);
+
+	if ((scan.hw_id >= 0) && i2c_soil_probe_hw_id_ok(scan.hw_id) &&
+	    !i2c_soil_drv_add_sensor(bus_num, addr)) {
+	    found++;
+	}
+    }
+
+    printk(KERN_INFO "i2c-soil-drv: scan: %d sensor(s) found on i2c adapter %d\n",
+	   found, bus_num);
+}
+
+/* Scan adapter bus_num for sensors in the background */
+void i2c_soil_probe_scan(int bus_num)
+{
+    async_schedule_domain(i2c_soil_probe_scan_async, (void *)(long)bus_num,
+			  &i2c_soil_probe_domain);
+}
+
+/* 0 if the sensor is ready, -EAGAIN while probing, -ENODEV if absent */
+int i2c_soil_probe_ready(struct i2c_soil_dev *p_dev)
+{
+    switch (smp_load_acquire(&p_dev->probe_state)) {
+    case I2C_SOIL_PROBE_READY:
+	return 0;
+    case I2C_SOIL_PROBE_PENDING:
+	return -EAGAIN;
+    default:
+	return -ENODEV;
+    }
+}
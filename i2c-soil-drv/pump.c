@@ -0,0 +1,311 @@
+/**************************************************************************
+ *
+ * pump.c
+ *
+ * Autonomous watering for the i2c soil moisture driver. The driver
+ * drives the pump's gpio itself, straight from the sample path, so
+ * watering carries on while soil-monitor is restarting or stalled,
+ * and the time from a dry reading to the pump starting is a few
+ * microseconds on the bus worker rather than a daemon's wakeup.
+ *
+ * The pump_gpio module parameter is the pump line's offset on gpio
+ * chip pump_chip (17 is the RPi header pin soil-monitor uses), and
+ * pump_sensor the sensor that decides when to water. Then, in that
+ * sensor's /sys/class/i2c-soil-drv/<dev>/, with pump_enable set the
+ * pump starts on a sample below pump_target, and stops at the first
+ * sample at or above it, on a failed reading, or after pump_max_on_ms,
+ * whichever comes first. An hrtimer enforces the limit, so a stalled
+ * bus or a dead sensor can't leave the pump running. The pump then
+ * stays off for at least pump_rest_ms, so the water can soak down to
+ * the sensor. pump_stats counts runs and the runs the limit cut short.
+ *
+ * The pump only reacts to published i2c samples, never simulated ones
+ * (sim mode, replays), so tests can't water the real soil. Set
+ * sample_period_ms for the driver to sample on its own. While the
+ * driver holds the line, soil-monitor's sysfs gpio export fails, so
+ * the two can't both drive the pump.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/machine.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <linux/version.h>
+
+#include "i2c-soil-drv-int.h"
+
+/* Turn the pump off at now. Called with pump_lock held. */
+static void i2c_soil_pump_off(struct i2c_soil_dev *p_dev, ktime_t now)
+{
+    gpiod_set_value(p_dev->p_pump, 0);
+    p_dev->pump_on = 0;
+    p_dev->pump_stop = now;
+    p_dev->pump_on_ns += ktime_to_ns(ktime_sub(now, p_dev->pump_start));
+}
+
+/*
+ * pump_max_on_ms is up. A run the samples already ended may still get
+ * here, if it lost the race with hrtimer_try_to_cancel, and a new run
+ * may have started since; only a run past its deadline is stopped.
+ * This is a soft timer: a millisecond cutoff doesn't need hard irq
+ * expiry, and on PREEMPT_RT pump_lock and the gpio chip lock sleep.
+ */
+static enum hrtimer_restart i2c_soil_pump_timer(struct hrtimer *timer)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(timer, struct i2c_soil_dev, pump_timer);
+    unsigned long flags;
+    ktime_t now;
+
+    spin_lock_irqsave(&p_dev->pump_lock, flags);
+    now = ktime_get();
+    if (p_dev->pump_on && !ktime_before(now, p_dev->pump_deadline)) {
+	i2c_soil_pump_off(p_dev, now);
+	p_dev->pump_safety_stops++;
+    }
+    spin_unlock_irqrestore(&p_dev->pump_lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+void i2c_soil_pump_init(struct i2c_soil_dev *p_dev)
+{
+    spin_lock_init(&p_dev->pump_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&p_dev->pump_timer, i2c_soil_pump_timer, CLOCK_MONOTONIC,
+		  HRTIMER_MODE_ABS);
+#else
+    hrtimer_init(&p_dev->pump_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    p_dev->pump_timer.function = i2c_soil_pump_timer;
+#endif
+    p_dev->pump_target = I2C_SOIL_PUMP_TARGET;
+    p_dev->pump_max_on_ms = I2C_SOIL_PUMP_MAX_ON_MS;
+    p_dev->pump_rest_ms = I2C_SOIL_PUMP_REST_MS;
+}
+
+/*
+ * Claim line offset on gpio chip chip_label as p_dev's pump, driven
+ * low (off). Call before the device is added, so the pump attributes
+ * show. Returns 0 or -ERRNO.
+ */
+int i2c_soil_pump_attach(struct i2c_soil_dev *p_dev, const char *chip_label,
+			 unsigned int offset)
+{
+    struct gpiod_lookup_table *p_lookup;
+    struct gpio_desc *p_pump;
+
+    /* The sensor isn't a firmware node, so map the line to it by name */
+    p_lookup = kzalloc(struct_size(p_lookup, table, 2), GFP_KERNEL);
+    if (!p_lookup) {
+	return -ENOMEM;
+    }
+    p_lookup->dev_id = dev_name(&p_dev->dev);
+    p_lookup->table[0] = (struct gpiod_lookup)
+	GPIO_LOOKUP(chip_label, offset, "pump", GPIO_ACTIVE_HIGH);
+    gpiod_add_lookup_table(p_lookup);
+
+    p_pump = gpiod_get(&p_dev->dev, "pump", GPIOD_OUT_LOW);
+    if (IS_ERR(p_pump)) {
+	printk(KERN_WARNING "i2c-soil-drv: sensor %d: can't get pump gpio %s %u, retval=%ld\n",
+	       p_dev->index, chip_label, offset, PTR_ERR(p_pump));
+	gpiod_remove_lookup_table(p_lookup);
+	kfree(p_lookup);
+	return PTR_ERR(p_pump);
+    }
+    /* The safety timer switches it off in softirq context */
+    if (gpiod_cansleep(p_pump)) {
+	printk(KERN_WARNING "i2c-soil-drv: sensor %d: pump gpio %s %u is on a sleeping gpio chip\n",
+	       p_dev->index, chip_label, offset);
+	gpiod_put(p_pump);
+	gpiod_remove_lookup_table(p_lookup);
+	kfree(p_lookup);
+	return -EINVAL;
+    }
+
+    p_dev->p_pump_lookup = p_lookup;
+    p_dev->p_pump = p_pump;
+    return 0;
+}
+
+/* Switch the pump off for good and release the line; no-op if none */
+void i2c_soil_pump_detach(struct i2c_soil_dev *p_dev)
+{
+    unsigned long flags;
+
+    if (!p_dev->p_pump) {
+	return;
+    }
+
+    spin_lock_irqsave(&p_dev->pump_lock, flags);
+    p_dev->pump_enable = 0;
+    if (p_dev->pump_on) {
+	i2c_soil_pump_off(p_dev, ktime_get());
+    }
+    spin_unlock_irqrestore(&p_dev->pump_lock, flags);
+    hrtimer_cancel(&p_dev->pump_timer);
+
+    gpiod_put(p_dev->p_pump);
+    p_dev->p_pump = NULL;
+    gpiod_remove_lookup_table(p_dev->p_pump_lookup);
+    kfree(p_dev->p_pump_lookup);
+    p_dev->p_pump_lookup = NULL;
+}
+
+/*
+ * Start or stop the pump on a newly published i2c sample. Called from
+ * i2c_soil_drv_publish, outside sample_lock, before readers are woken.
+ */
+void i2c_soil_pump_sample(struct i2c_soil_dev *p_dev,
+			  const struct i2c_soil_sample *p_sample)
+{
+    unsigned long flags;
+    ktime_t now;
+
+    if (!p_dev->p_pump) {
+	return;
+    }
+
+    spin_lock_irqsave(&p_dev->pump_lock, flags);
+    now = ktime_get();
+    if (p_dev->pump_on) {
+	if ((p_sample->val < 0) || (p_sample->val >= p_dev->pump_target)) {
+	    i2c_soil_pump_off(p_dev, now);
+	    hrtimer_try_to_cancel(&p_dev->pump_timer);
+	}
+    } else if (p_dev->pump_enable && (p_sample->val >= 0) &&
+	       (p_sample->val < p_dev->pump_target) &&
+	       (!p_dev->pump_runs ||
+		!ktime_before(now, ktime_add_ms(p_dev->pump_stop,
+						p_dev->pump_rest_ms)))) {
+	gpiod_set_value(p_dev->p_pump, 1);
+	p_dev->pump_on = 1;
+	p_dev->pump_start = now;
+	p_dev->pump_deadline = ktime_add_ms(now, p_dev->pump_max_on_ms);
+	p_dev->pump_runs++;
+	p_dev->pump_latency_ns = ktime_to_ns(ktime_sub(now, p_sample->timestamp));
+	hrtimer_start(&p_dev->pump_timer, p_dev->pump_deadline,
+		      HRTIMER_MODE_ABS);
+    }
+    spin_unlock_irqrestore(&p_dev->pump_lock, flags);
+}
+
+static ssize_t pump_enable_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_i2c_soil_dev(dev)->pump_enable));
+}
+
+/* 0 also stops a run in progress */
+static ssize_t pump_enable_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    unsigned long flags;
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if (val > 1) {
+	return -EINVAL;
+    }
+
+    spin_lock_irqsave(&p_dev->pump_lock, flags);
+    p_dev->pump_enable = val;
+    if (!val && p_dev->pump_on) {
+	i2c_soil_pump_off(p_dev, ktime_get());
+	hrtimer_try_to_cancel(&p_dev->pump_timer);
+    }
+    spin_unlock_irqrestore(&p_dev->pump_lock, flags);
+    return count;
+}
+static DEVICE_ATTR_RW(pump_enable);
+
+/* Settings for the next run; the pump code reads them under pump_lock */
+#define I2C_SOIL_PUMP_ATTR(_name, _min, _max)				\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_i2c_soil_dev(dev)->_name)); \
+}									\
+static ssize_t _name##_store(struct device *dev,			\
+			     struct device_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);			\
+    unsigned long flags;						\
+    unsigned int val;							\
+    int retval;								\
+									\
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {			\
+	return retval;							\
+    }									\
+    if ((val < (_min)) || (val > (_max))) {				\
+	return -EINVAL;							\
+    }									\
+    spin_lock_irqsave(&p_dev->pump_lock, flags);			\
+    p_dev->_name = val;							\
+    spin_unlock_irqrestore(&p_dev->pump_lock, flags);			\
+    return count;							\
+}									\
+static DEVICE_ATTR_RW(_name)
+
+I2C_SOIL_PUMP_ATTR(pump_target, 1, I2C_MAX_WET_READING);
+I2C_SOIL_PUMP_ATTR(pump_max_on_ms, 1, I2C_SOIL_MAX_PUMP_ON_MS);
+I2C_SOIL_PUMP_ATTR(pump_rest_ms, 0, I2C_SOIL_MAX_PUMP_REST_MS);
+
+/* "name value" lines, like bench_result */
+static ssize_t pump_stats_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    u32 runs, safety_stops;
+    u64 on_ns, latency_ns;
+    unsigned long flags;
+    int on;
+
+    spin_lock_irqsave(&p_dev->pump_lock, flags);
+    on = p_dev->pump_on;
+    runs = p_dev->pump_runs;
+    safety_stops = p_dev->pump_safety_stops;
+    on_ns = p_dev->pump_on_ns;
+    latency_ns = p_dev->pump_latency_ns;
+    spin_unlock_irqrestore(&p_dev->pump_lock, flags);
+
+    return sysfs_emit(buf, "on %d\nruns %u\nsafety_stops %u\non_ms %llu\nlatency_ns %llu\n",
+		      on, runs, safety_stops, div_u64(on_ns, NSEC_PER_MSEC), latency_ns);
+}
+static DEVICE_ATTR_RO(pump_stats);
+
+static struct attribute *i2c_soil_pump_attrs[] = {
+    &dev_attr_pump_enable.attr,
+    &dev_attr_pump_target.attr,
+    &dev_attr_pump_max_on_ms.attr,
+    &dev_attr_pump_rest_ms.attr,
+    &dev_attr_pump_stats.attr,
+    NULL,
+};
+
+/* Only the sensor with the pump has the attributes */
+static umode_t i2c_soil_pump_visible(struct kobject *kobj,
+				     struct attribute *attr, int n)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(kobj_to_dev(kobj));
+
+    return p_dev->p_pump ? attr->mode : 0;
+}
+
+const struct attribute_group i2c_soil_pump_group = {
+    .attrs = i2c_soil_pump_attrs,
+    .is_visible = i2c_soil_pump_visible,
+};
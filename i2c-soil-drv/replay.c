@@ -0,0 +1,192 @@
+/**************************************************************************
+ *
+ * replay.c
+ *
+ * Simulated sample replay for the i2c soil moisture driver, so that
+ * captured field traces (eg from record mode) can be played into every
+ * consumer, at their recorded spacing or N times faster, with a single
+ * I2C_SOIL_IOC_REPLAY call instead of one write per value.
+ *
+ * Each sample goes through the normal path (sample buffer, readers,
+ * pollers and netlink) as a simulated reading, and also becomes the
+ * device's sim_data. The device must be in sim mode; turning sim mode
+ * off stops the replay at once. /sys/class/i2c-soil-drv/<dev>/replay
+ * shows the progress.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/sysfs.h>
+
+#include "i2c-soil-drv-int.h"
+
+/*
+ * Inject replay_len samples, each at the start time plus its offset
+ * from the first sample over replay_speed. Deadlines are absolute, so
+ * time taken publishing doesn't accumulate. Gaps in a field trace can
+ * be hours long, so the wait is interruptible (no hung task reports);
+ * stopping it or turning sim mode off wakes it.
+ */
+static void i2c_soil_replay_work(struct work_struct *work)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(work, struct i2c_soil_dev, replay_work);
+    struct i2c_soil_replay_sample *p_buf = p_dev->p_replay_buf;
+    unsigned int speed = p_dev->replay_speed;
+    ktime_t start = ktime_get();
+    ktime_t due;
+
+    for (unsigned int i = 0; i < p_dev->replay_len; i++) {
+	if (speed) {
+	    due = ktime_add_ns(start, div_u64(p_buf[i].timestamp_ns -
+					      p_buf[0].timestamp_ns, speed));
+	    wait_event_interruptible_hrtimeout(p_dev->replay_wq,
+					       READ_ONCE(p_dev->replay_abort) ||
+					       !READ_ONCE(p_dev->use_simulation),
+					       ktime_sub(due, ktime_get()));
+	}
+	if (READ_ONCE(p_dev->replay_abort) || !READ_ONCE(p_dev->use_simulation)) {
+	    break;
+	}
+
+	WRITE_ONCE(p_dev->sim_data, p_buf[i].value);
+	i2c_soil_drv_inject(p_dev, p_buf[i].value);
+	WRITE_ONCE(p_dev->replay_done, i + 1);
+    }
+
+    smp_store_release(&p_dev->replay_running, 0);
+}
+
+void i2c_soil_replay_init(struct i2c_soil_dev *p_dev)
+{
+    mutex_init(&p_dev->replay_lock);
+    init_waitqueue_head(&p_dev->replay_wq);
+    INIT_WORK(&p_dev->replay_work, i2c_soil_replay_work);
+}
+
+/* Stop any replay in progress. Called with replay_lock held. */
+static void i2c_soil_replay_stop(struct i2c_soil_dev *p_dev)
+{
+    WRITE_ONCE(p_dev->replay_abort, 1);
+    wake_up(&p_dev->replay_wq);
+    cancel_work_sync(&p_dev->replay_work);
+    p_dev->replay_running = 0;	/* In case it never got to run */
+}
+
+/* Stop any replay in progress and free the samples */
+void i2c_soil_replay_cleanup(struct i2c_soil_dev *p_dev)
+{
+    mutex_lock(&p_dev->replay_lock);
+    i2c_soil_replay_stop(p_dev);
+    kvfree(p_dev->p_replay_buf);
+    p_dev->p_replay_buf = NULL;
+    mutex_unlock(&p_dev->replay_lock);
+}
+
+/*
+ * I2C_SOIL_IOC_REPLAY: start replaying p_replay's samples, replacing
+ * the previous ones, or with a count of 0 stop the replay in progress.
+ * Returns 0 or -ERRNO.
+ */
+int i2c_soil_replay_start(struct i2c_soil_dev *p_dev,
+			  const struct i2c_soil_replay *p_replay)
+{
+    struct i2c_soil_replay_sample *p_buf;
+    int retval = 0;
+
+    if (!p_replay->count) {
+	mutex_lock(&p_dev->replay_lock);
+	i2c_soil_replay_stop(p_dev);
+	mutex_unlock(&p_dev->replay_lock);
+	return 0;
+    }
+    if (p_replay->count > I2C_SOIL_MAX_REPLAY) {
+	return -EINVAL;
+    }
+    if (!READ_ONCE(p_dev->use_simulation)) {
+	return -EINVAL;		/* Would mix with real readings */
+    }
+
+    p_buf = kvmalloc_array(p_replay->count, sizeof(*p_buf), GFP_KERNEL);
+    if (!p_buf) {
+	return -ENOMEM;
+    }
+    if (copy_from_user(p_buf, u64_to_user_ptr(p_replay->samples),
+		       p_replay->count * sizeof(*p_buf))) {
+	retval = -EFAULT;
+	goto free_buf;
+    }
+    for (unsigned int i = 0; i < p_replay->count; i++) {
+	if ((p_buf[i].value > I2C_MAX_WET_READING) ||
+	    (i && (p_buf[i].timestamp_ns < p_buf[i - 1].timestamp_ns))) {
+	    retval = -EINVAL;
+	    goto free_buf;
+	}
+    }
+
+    mutex_lock(&p_dev->replay_lock);
+    if (READ_ONCE(p_dev->removed)) {
+	/* Cleanup has run, or will cancel this under replay_lock */
+	mutex_unlock(&p_dev->replay_lock);
+	retval = -ENODEV;
+	goto free_buf;
+    }
+    if (p_dev->replay_running) {
+	mutex_unlock(&p_dev->replay_lock);
+	retval = -EBUSY;
+	goto free_buf;
+    }
+    kvfree(p_dev->p_replay_buf);
+    p_dev->p_replay_buf = p_buf;
+    p_dev->replay_len = p_replay->count;
+    p_dev->replay_speed = p_replay->speed;
+    p_dev->replay_done = 0;
+    p_dev->replay_abort = 0;
+    p_dev->replay_running = 1;
+    /* Long running (mostly sleeping), so not on a bound workqueue */
+    queue_work(system_unbound_wq, &p_dev->replay_work);
+    mutex_unlock(&p_dev->replay_lock);
+    return 0;
+
+free_buf:
+    kvfree(p_buf);
+    return retval;
+}
+
+static ssize_t replay_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+
+    if (smp_load_acquire(&p_dev->replay_running)) {
+	return sysfs_emit(buf, "running %u/%u\n",
+			  READ_ONCE(p_dev->replay_done), p_dev->replay_len);
+    } else if (p_dev->p_replay_buf) {
+	return sysfs_emit(buf, "done %u/%u\n",
+			  READ_ONCE(p_dev->replay_done), p_dev->replay_len);
+    } else {
+	return sysfs_emit(buf, "idle\n");
+    }
+}
+static DEVICE_ATTR_RO(replay);
+
+static struct attribute *i2c_soil_replay_attrs[] = {
+    &dev_attr_replay.attr,
+    NULL,
+};
+
+const struct attribute_group i2c_soil_replay_group = {
+    .attrs = i2c_soil_replay_attrs,
+};
@@ -0,0 +1,464 @@
+/**************************************************************************
+ *
+ * sched.c
+ *
+ * Bus-aware acquisition scheduler for the i2c soil moisture driver.
+ *
+ * Each i2c adapter in use gets one kthread worker, and every
+ * transaction for a sensor on that adapter (periodic or on-demand)
+ * runs there. Sensors sharing a bus are therefore serialized, while
+ * sensors on different buses are sampled in parallel.
+ *
+ * With the rt_sched module parameter, bus workers run SCHED_FIFO (and
+ * on CPU rt_cpu if given), and periodic sampling is paced by absolute
+ * hrtimers rather than jiffy based delayed work. Either way, each
+ * periodic sample's lateness against its ideal time is kept as a
+ * histogram, in the sensor's jitter attribute.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+#include "i2c-soil-drv-int.h"
+
+/*
+ * At most one bus per sensor. Entries are added by the (concurrent)
+ * sensor probes under i2c_soil_bus_lock, and only removed at cleanup.
+ */
+static struct i2c_soil_bus i2c_soil_buses[I2C_SOIL_MAX_DEVS];
+static int i2c_soil_num_buses;
+static DEFINE_MUTEX(i2c_soil_bus_lock);
+
+static struct dentry *i2c_soil_debugfs_dir;
+
+/*
+ * Find the entry for adapter bus_num, taking an adapter reference and
+ * starting its worker on first use. Returns the bus or ERR_PTR.
+ */
+static struct i2c_soil_bus *__i2c_soil_bus_get(int bus_num)
+{
+    struct i2c_soil_bus *p_bus;
+
+    for (int i = 0; i < i2c_soil_num_buses; i++) {
+	if (i2c_soil_buses[i].bus_num == bus_num) {
+	    return &i2c_soil_buses[i];
+	}
+    }
+
+    if (i2c_soil_num_buses >= ARRAY_SIZE(i2c_soil_buses)) {
+	return ERR_PTR(-ENOSPC);
+    }
+
+    p_bus = &i2c_soil_buses[i2c_soil_num_buses];
+    memset(p_bus, 0, sizeof(struct i2c_soil_bus));
+
+    p_bus->p_i2c_adapter = i2c_get_adapter(bus_num);
+    /* Looking at i2c-core-base.c, returns NULL on error */
+    if (!(p_bus->p_i2c_adapter)) {
+	printk(KERN_WARNING "i2c-soil-drv: i2c_get_adapter(%d) failed\n", bus_num);
+	return ERR_PTR(-ENODEV);
+    }
+
+    p_bus->p_worker = kthread_create_worker(0, "i2c-soil/%d", bus_num);
+    if (IS_ERR(p_bus->p_worker)) {
+	printk(KERN_WARNING "i2c-soil-drv: kthread_create_worker failed\n");
+	i2c_put_adapter(p_bus->p_i2c_adapter);
+	return ERR_CAST(p_bus->p_worker);
+    }
+    if (i2c_soil_rt_sched) {
+	/* Preempts userspace and normal kthreads, not the irq threads */
+	sched_set_fifo(p_bus->p_worker->task);
+	if (i2c_soil_rt_cpu >= 0) {
+	    set_cpus_allowed_ptr(p_bus->p_worker->task,
+				 cpumask_of(i2c_soil_rt_cpu));
+	}
+    }
+
+    p_bus->bus_num = bus_num;
+    p_bus->bus_index = i2c_soil_num_buses;
+    spin_lock_init(&p_bus->stats_lock);
+    p_bus->stats_start = ktime_get();
+    /* debugfs walks the table unlocked; publish the entry complete */
+    smp_store_release(&i2c_soil_num_buses, i2c_soil_num_buses + 1);
+    return p_bus;
+}
+
+/* Get the bus for adapter bus_num as above. Returns the bus or ERR_PTR. */
+struct i2c_soil_bus *i2c_soil_bus_get(int bus_num)
+{
+    struct i2c_soil_bus *p_bus;
+
+    mutex_lock(&i2c_soil_bus_lock);
+    p_bus = __i2c_soil_bus_get(bus_num);
+    mutex_unlock(&i2c_soil_bus_lock);
+    return p_bus;
+}
+
+/*
+ * Give a sensor attached to p_bus the next slot on it, for phase
+ * spreading. Only once the attach has succeeded, so num_devs counts
+ * sensors really sampled there. Returns the slot.
+ */
+int i2c_soil_bus_add_dev(struct i2c_soil_bus *p_bus)
+{
+    int slot;
+
+    mutex_lock(&i2c_soil_bus_lock);
+    slot = p_bus->num_devs++;
+    mutex_unlock(&i2c_soil_bus_lock);
+    return slot;
+}
+
+/* Stop all bus workers and drop the adapter references. */
+void i2c_soil_bus_put_all(void)
+{
+    while (i2c_soil_num_buses > 0) {
+	struct i2c_soil_bus *p_bus = &i2c_soil_buses[--i2c_soil_num_buses];
+
+	kthread_destroy_worker(p_bus->p_worker);
+	i2c_put_adapter(p_bus->p_i2c_adapter);
+    }
+}
+
+/* Add one transaction, started at start, to the bus utilization. */
+void i2c_soil_sched_account(struct i2c_soil_bus *p_bus, ktime_t start)
+{
+    u64 busy_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    spin_lock(&p_bus->stats_lock);
+    p_bus->busy_ns += busy_ns;
+    p_bus->num_samples++;
+    spin_unlock(&p_bus->stats_lock);
+}
+
+/* On-demand acquisition, queued by non-blocking and blocking readers */
+static void i2c_soil_sample_work(struct kthread_work *work)
+{
+    i2c_soil_drv_acquire(container_of(work, struct i2c_soil_dev, sample_work));
+}
+
+/* Add one periodic sample, due at deadline, to the jitter histogram */
+static void i2c_soil_sched_jitter(struct i2c_soil_dev *p_dev, ktime_t deadline)
+{
+    u64 jitter_ns = abs(ktime_to_ns(ktime_sub(ktime_get(), deadline)));
+    u64 jitter_us = div_u64(jitter_ns, NSEC_PER_USEC);
+    int bucket = jitter_us ?
+	min_t(int, fls64(jitter_us), I2C_SOIL_JITTER_BUCKETS - 1) : 0;
+
+    spin_lock(&p_dev->sample_lock);
+    p_dev->jitter_hist[bucket]++;
+    p_dev->jitter_count++;
+    p_dev->jitter_sum_ns += jitter_ns;
+    p_dev->jitter_max_ns = max(p_dev->jitter_max_ns, jitter_ns);
+    spin_unlock(&p_dev->sample_lock);
+}
+
+void i2c_soil_sched_jitter_reset(struct i2c_soil_dev *p_dev)
+{
+    spin_lock(&p_dev->sample_lock);
+    memset(p_dev->jitter_hist, 0, sizeof(p_dev->jitter_hist));
+    p_dev->jitter_count = 0;
+    p_dev->jitter_sum_ns = 0;
+    p_dev->jitter_max_ns = 0;
+    spin_unlock(&p_dev->sample_lock);
+}
+
+/*
+ * Periodic acquisition. Deadlines are absolute, so time spent waiting
+ * for the bus doesn't accumulate as drift. If the bus can't keep up
+ * and a whole period was missed, skip the missed slots instead of
+ * bursting to catch up.
+ */
+static void i2c_soil_sched_work(struct kthread_work *work)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(work, struct i2c_soil_dev, sched_work.work);
+    unsigned int period_ms = READ_ONCE(p_dev->sample_period_ms);
+    ktime_t now;
+
+    if (!period_ms) {
+	return;
+    }
+
+    i2c_soil_sched_jitter(p_dev, p_dev->next_deadline);
+    i2c_soil_drv_acquire(p_dev);
+
+    now = ktime_get();
+    p_dev->next_deadline = ktime_add_ms(p_dev->next_deadline, period_ms);
+    if (!ktime_after(p_dev->next_deadline, now)) {
+	u64 behind_ms = ktime_ms_delta(now, p_dev->next_deadline);
+
+	p_dev->next_deadline =
+	    ktime_add_ms(p_dev->next_deadline,
+			 (div_u64(behind_ms, period_ms) + 1) * period_ms);
+    }
+
+    kthread_queue_delayed_work(p_dev->p_bus->p_worker, &p_dev->sched_work,
+			       msecs_to_jiffies(ktime_ms_delta(p_dev->next_deadline,
+							       now)));
+}
+
+/*
+ * rt_sched mode: the timer only queues the acquisition, so the i2c
+ * transfer still runs on the bus worker. A sample still queued when
+ * the next one is due absorbs it, skipping the slot as above.
+ */
+static enum hrtimer_restart i2c_soil_sched_timer(struct hrtimer *timer)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(timer, struct i2c_soil_dev, sched_timer);
+    unsigned int period_ms = READ_ONCE(p_dev->sample_period_ms);
+
+    if (!period_ms) {
+	return HRTIMER_NORESTART;
+    }
+    atomic64_set(&p_dev->rt_deadline, ktime_to_ns(hrtimer_get_expires(timer)));
+    kthread_queue_work(p_dev->p_bus->p_worker, &p_dev->sched_rt_work);
+    hrtimer_forward_now(timer, ms_to_ktime(period_ms));
+    return HRTIMER_RESTART;
+}
+
+static void i2c_soil_sched_rt_work(struct kthread_work *work)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(work, struct i2c_soil_dev, sched_rt_work);
+
+    i2c_soil_sched_jitter(p_dev, ns_to_ktime(atomic64_read(&p_dev->rt_deadline)));
+    i2c_soil_drv_acquire(p_dev);
+}
+
+/* Stop periodic sampling, in either mode */
+static void i2c_soil_sched_cancel(struct i2c_soil_dev *p_dev)
+{
+    kthread_cancel_delayed_work_sync(&p_dev->sched_work);
+    hrtimer_cancel(&p_dev->sched_timer);
+    kthread_cancel_work_sync(&p_dev->sched_rt_work);
+}
+
+/*
+ * Speculative on-demand acquisition, timed by i2c_soil_prefetch_want
+ * to complete just before the next expected read.
+ */
+static void i2c_soil_prefetch_work(struct kthread_work *work)
+{
+    struct i2c_soil_dev *p_dev =
+	container_of(work, struct i2c_soil_dev, prefetch_work.work);
+
+    if (READ_ONCE(p_dev->sample_period_ms)) {
+	return;
+    }
+
+    spin_lock(&p_dev->sample_lock);
+    p_dev->prefetch_busy = 1;
+    spin_unlock(&p_dev->sample_lock);
+
+    i2c_soil_drv_acquire(p_dev);
+
+    spin_lock(&p_dev->sample_lock);
+    p_dev->prefetch_busy = 0;
+    p_dev->prefetch_seq = p_dev->sample_seq;
+    spin_unlock(&p_dev->sample_lock);
+}
+
+/*
+ * On-demand read arriving at now; called with sample_lock held.
+ * Returns the sample_seq the read should wait for, and sets *kick if
+ * that needs a new acquisition.
+ *
+ * A prefetched sample not yet returned, and taken within a quarter
+ * interval of this read, is returned as is; a prefetch still running
+ * is waited for. Either way the reader sees no conversion delay.
+ *
+ * Reads also train the prefetch: while they arrive on a steady cadence
+ * (each interval within 25% of the smoothed one), the next prefetch is
+ * armed to complete just before the next read is due. Between reads
+ * the bus stays idle.
+ */
+u32 i2c_soil_prefetch_want(struct i2c_soil_dev *p_dev, ktime_t now, int *kick)
+{
+    struct i2c_soil_sample *p_latest =
+	&p_dev->ring[p_dev->sample_seq & (I2C_SOIL_RING_LEN - 1)];
+    u64 interval_ns = p_dev->read_interval_ns;
+    u32 want = p_dev->sample_seq + 1;
+    int steady = 0;
+    u64 delta_ns, lead_ns;
+
+    *kick = 1;
+    if (p_dev->prefetch_busy) {
+	*kick = 0;
+    } else if (p_dev->prefetch_seq && (p_dev->prefetch_seq == p_dev->sample_seq) &&
+	       (ktime_to_ns(ktime_sub(now, p_latest->timestamp)) <= (interval_ns >> 2))) {
+	want = p_dev->sample_seq;
+	*kick = 0;
+    }
+    p_dev->prefetch_seq = 0;
+
+    if (p_dev->last_read) {
+	delta_ns = ktime_to_ns(ktime_sub(now, p_dev->last_read));
+	steady = interval_ns && (abs_diff(delta_ns, interval_ns) <= (interval_ns >> 2));
+	p_dev->read_interval_ns = i2c_soil_ewma(interval_ns, delta_ns);
+    }
+    p_dev->last_read = now;
+
+    if (!steady || !READ_ONCE(p_dev->prefetch) ||
+	READ_ONCE(p_dev->use_simulation) || p_dev->virtual_dev ||
+	i2c_soil_probe_ready(p_dev)) {
+	return want;		/* Simulated reads are instant anyway */
+    }
+
+    lead_ns = p_dev->acq_ns + I2C_SOIL_PREFETCH_SLACK_NS;
+    if (p_dev->read_interval_ns > lead_ns) {
+	kthread_mod_delayed_work(p_dev->p_bus->p_worker, &p_dev->prefetch_work,
+				 nsecs_to_jiffies(p_dev->read_interval_ns - lead_ns));
+    }
+    return want;
+}
+
+void i2c_soil_sched_init(struct i2c_soil_dev *p_dev)
+{
+    kthread_init_work(&p_dev->sample_work, i2c_soil_sample_work);
+    kthread_init_delayed_work(&p_dev->sched_work, i2c_soil_sched_work);
+    kthread_init_delayed_work(&p_dev->prefetch_work, i2c_soil_prefetch_work);
+    kthread_init_work(&p_dev->sched_rt_work, i2c_soil_sched_rt_work);
+    /* Hard irq expiry, so pacing holds on PREEMPT_RT kernels too */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&p_dev->sched_timer, i2c_soil_sched_timer, CLOCK_MONOTONIC,
+		  HRTIMER_MODE_ABS_HARD);
+#else
+    hrtimer_init(&p_dev->sched_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+    p_dev->sched_timer.function = i2c_soil_sched_timer;
+#endif
+}
+
+/* Queue a single acquisition on the sensor's bus worker. */
+void i2c_soil_sched_request(struct i2c_soil_dev *p_dev)
+{
+    kthread_queue_work(p_dev->p_bus->p_worker, &p_dev->sample_work);
+}
+
+/*
+ * Start periodic sampling if the sensor has a sample period, once it is
+ * ready (see probe.c). The phase depends on how many sensors share the
+ * bus, so sensors probed early on a bus may start out bunched up; any
+ * later period change spreads them out again.
+ */
+void i2c_soil_sched_start(struct i2c_soil_dev *p_dev)
+{
+    struct i2c_soil_bus *p_bus = p_dev->p_bus;
+    unsigned int period_ms = p_dev->sample_period_ms;
+    int nbuses;
+    u64 phase_ms;
+
+    if (!period_ms) {
+	return;
+    }
+
+    /*
+     * Give every sensor its own phase: sensors on one bus are spread
+     * evenly over the period, and buses are interleaved between them,
+     * so neither a bus nor the CPU sees a burst of simultaneous
+     * deadlines.
+     */
+    nbuses = max(READ_ONCE(i2c_soil_num_buses), 1);
+    phase_ms = div_u64((u64)period_ms *
+		       (p_dev->bus_slot * nbuses + p_bus->bus_index),
+		       READ_ONCE(p_bus->num_devs) * nbuses);
+    p_dev->next_deadline = ktime_add_ms(ktime_get(), phase_ms);
+    if (i2c_soil_rt_sched) {
+	hrtimer_start(&p_dev->sched_timer, p_dev->next_deadline,
+		      HRTIMER_MODE_ABS_HARD);
+    } else {
+	kthread_queue_delayed_work(p_bus->p_worker, &p_dev->sched_work,
+				   msecs_to_jiffies(phase_ms));
+    }
+}
+
+/*
+ * Change the sample period at runtime. Switching to on-demand kicks
+ * one acquisition, since readers may be waiting for a periodic sample
+ * that will now never come.
+ */
+void i2c_soil_sched_set_period(struct i2c_soil_dev *p_dev,
+			       unsigned int period_ms)
+{
+    unsigned int old_period_ms = p_dev->sample_period_ms;
+
+    if (i2c_soil_probe_ready(p_dev)) {
+	/* Not attached yet; the probe starts sampling with the new period */
+	WRITE_ONCE(p_dev->sample_period_ms, period_ms);
+	return;
+    }
+
+    i2c_soil_sched_cancel(p_dev);
+    WRITE_ONCE(p_dev->sample_period_ms, period_ms);
+    if (period_ms) {
+	i2c_soil_sched_start(p_dev);
+    } else if (old_period_ms) {
+	i2c_soil_sched_request(p_dev);
+    }
+}
+
+/* Cancel periodic, prefetch and on-demand work; safe even though they requeue. */
+void i2c_soil_sched_stop(struct i2c_soil_dev *p_dev)
+{
+    i2c_soil_sched_cancel(p_dev);
+    kthread_cancel_delayed_work_sync(&p_dev->prefetch_work);
+    kthread_cancel_work_sync(&p_dev->sample_work);
+}
+
+/*
+ * debugfs "buses": per-bus utilization since module load. Readers
+ * wanting a rate over an interval can read twice and diff.
+ */
+static int i2c_soil_buses_show(struct seq_file *s, void *unused)
+{
+    int nbuses = smp_load_acquire(&i2c_soil_num_buses);
+
+    seq_puts(s, "bus sensors samples busy_us elapsed_us util%\n");
+    for (int i = 0; i < nbuses; i++) {
+	struct i2c_soil_bus *p_bus = &i2c_soil_buses[i];
+	u64 busy_ns, num_samples, elapsed_ns, util;
+	u32 util_frac;
+
+	spin_lock(&p_bus->stats_lock);
+	busy_ns = p_bus->busy_ns;
+	num_samples = p_bus->num_samples;
+	elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), p_bus->stats_start));
+	spin_unlock(&p_bus->stats_lock);
+
+	/* Hundredths of a percent */
+	util = elapsed_ns ? div64_u64(busy_ns * 10000, elapsed_ns) : 0;
+	util = div_u64_rem(util, 100, &util_frac);
+	seq_printf(s, "%d %d %llu %llu %llu %llu.%02u\n", p_bus->bus_num,
+		   p_bus->num_devs, num_samples, div_u64(busy_ns, 1000),
+		   div_u64(elapsed_ns, 1000), util, util_frac);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(i2c_soil_buses);
+
+/* debugfs is diagnostics only; failures are deliberately ignored. */
+void i2c_soil_debugfs_init(void)
+{
+    i2c_soil_debugfs_dir = debugfs_create_dir("i2c-soil-drv", NULL);
+    debugfs_create_file("buses", 0444, i2c_soil_debugfs_dir, NULL,
+			&i2c_soil_buses_fops);
+}
+
+void i2c_soil_debugfs_cleanup(void)
+{
+    debugfs_remove_recursive(i2c_soil_debugfs_dir);
+}
@@ -0,0 +1,311 @@
+/**************************************************************************
+ *
+ * sysfs.c
+ *
+ * Per-sensor runtime tunables for the i2c soil moisture driver, in
+ * /sys/class/i2c-soil-drv/<dev>/. Lets acquisition be retuned in the
+ * field without a rebuild or rmmod/insmod, which would drop every open
+ * file.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
+
+#include "i2c-soil-drv-int.h"
+
+/*
+ * Attributes that are a plain unsigned field, range checked. Readers
+ * of the field (the bus worker) pick up new values with READ_ONCE.
+ */
+#define I2C_SOIL_UINT_ATTR(_name, _max)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_i2c_soil_dev(dev)->_name)); \
+}									\
+static ssize_t _name##_store(struct device *dev,			\
+			     struct device_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+    unsigned int val;							\
+    int retval;								\
+									\
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {			\
+	return retval;							\
+    }									\
+    if (val > (_max)) {							\
+	return -EINVAL;							\
+    }									\
+    WRITE_ONCE(to_i2c_soil_dev(dev)->_name, val);			\
+    return count;							\
+}									\
+static DEVICE_ATTR_RW(_name)
+
+I2C_SOIL_UINT_ATTR(conv_delay_us, I2C_SOIL_MAX_CONV_DELAY_US);
+I2C_SOIL_UINT_ATTR(max_rereads, I2C_SOIL_MAX_REREADS_LIMIT);
+I2C_SOIL_UINT_ATTR(prefetch, 1);
+
+static ssize_t sample_period_ms_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%u\n",
+		      READ_ONCE(to_i2c_soil_dev(dev)->sample_period_ms));
+}
+
+/* 0 returns to on-demand sampling; anything else restarts the schedule */
+static ssize_t sample_period_ms_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+
+    mutex_lock(&p_dev->config_lock);
+    i2c_soil_sched_set_period(p_dev, val);
+    mutex_unlock(&p_dev->config_lock);
+    return count;
+}
+static DEVICE_ATTR_RW(sample_period_ms);
+
+static ssize_t filter_depth_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_i2c_soil_dev(dev)->filter_depth));
+}
+
+/* Moving average length; the history restarts empty on every change */
+static ssize_t filter_depth_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if ((val < 1) || (val > I2C_SOIL_MAX_FILTER_DEPTH)) {
+	return -EINVAL;
+    }
+
+    spin_lock(&p_dev->sample_lock);
+    p_dev->filter_depth = val;
+    p_dev->filter_len = 0;
+    p_dev->filter_pos = 0;
+    p_dev->filter_sum = 0;
+    spin_unlock(&p_dev->sample_lock);
+    return count;
+}
+static DEVICE_ATTR_RW(filter_depth);
+
+/*
+ * Dry and wet thresholds on the raw reading. They're updated under
+ * sample_lock, and must stay ordered, so normalization never divides
+ * by zero.
+ */
+static ssize_t i2c_soil_thresh_show(struct device *dev, char *buf, int wet)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    int val;
+
+    spin_lock(&p_dev->sample_lock);
+    val = wet ? p_dev->raw_wet : p_dev->raw_dry;
+    spin_unlock(&p_dev->sample_lock);
+    return sysfs_emit(buf, "%d\n", val);
+}
+
+static ssize_t i2c_soil_thresh_store(struct device *dev, const char *buf,
+				     size_t count, int wet)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    int val;
+    int retval;
+
+    if ((retval = kstrtoint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if ((val < 0) || (val > I2C_HIGH_OUT_OF_RANGE)) {
+	return -EINVAL;
+    }
+
+    spin_lock(&p_dev->sample_lock);
+    if (wet ? (val <= p_dev->raw_dry) : (val >= p_dev->raw_wet)) {
+	retval = -EINVAL;
+    } else if (wet) {
+	p_dev->raw_wet = val;
+    } else {
+	p_dev->raw_dry = val;
+    }
+    spin_unlock(&p_dev->sample_lock);
+    return retval ? retval : count;
+}
+
+static ssize_t raw_dry_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+    return i2c_soil_thresh_show(dev, buf, 0);
+}
+
+static ssize_t raw_dry_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+    return i2c_soil_thresh_store(dev, buf, count, 0);
+}
+static DEVICE_ATTR_RW(raw_dry);
+
+static ssize_t raw_wet_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+    return i2c_soil_thresh_show(dev, buf, 1);
+}
+
+static ssize_t raw_wet_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+    return i2c_soil_thresh_store(dev, buf, count, 1);
+}
+static DEVICE_ATTR_RW(raw_wet);
+
+/* Same effect as writing SIM_ON_CMD/SIM_OFF_CMD to the device */
+static ssize_t sim_show(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+    return sysfs_emit(buf, "%d\n", READ_ONCE(to_i2c_soil_dev(dev)->use_simulation));
+}
+
+static ssize_t sim_store(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count)
+{
+    bool val;
+    int retval;
+
+    if ((retval = kstrtobool(buf, &val)) < 0) {
+	return retval;
+    }
+    i2c_soil_drv_set_sim(to_i2c_soil_dev(dev), val);
+    return count;
+}
+static DEVICE_ATTR_RW(sim);
+
+/* Same effect as a single byte write to the device in sim mode */
+static ssize_t sim_data_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_i2c_soil_dev(dev)->sim_data));
+}
+
+static ssize_t sim_data_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+    u8 val;
+    int retval;
+
+    if ((retval = kstrtou8(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    WRITE_ONCE(to_i2c_soil_dev(dev)->sim_data, val);
+    return count;
+}
+static DEVICE_ATTR_RW(sim_data);
+
+/*
+ * Periodic sample time jitter, see sched.c: "<bucket> <count>" lines,
+ * where bucket is the upper bound in us ("inf" for the last), then the
+ * totals. Writing 0 clears it.
+ */
+static ssize_t jitter_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+    struct i2c_soil_dev *p_dev = to_i2c_soil_dev(dev);
+    u32 hist[I2C_SOIL_JITTER_BUCKETS];
+    u64 count, sum_ns, max_ns;
+    ssize_t len = 0;
+
+    spin_lock(&p_dev->sample_lock);
+    memcpy(hist, p_dev->jitter_hist, sizeof(hist));
+    count = p_dev->jitter_count;
+    sum_ns = p_dev->jitter_sum_ns;
+    max_ns = p_dev->jitter_max_ns;
+    spin_unlock(&p_dev->sample_lock);
+
+    for (int i = 0; i < I2C_SOIL_JITTER_BUCKETS - 1; i++) {
+	len += sysfs_emit_at(buf, len, "%lu %u\n", 1UL << i, hist[i]);
+    }
+    len += sysfs_emit_at(buf, len, "inf %u\n", hist[I2C_SOIL_JITTER_BUCKETS - 1]);
+    len += sysfs_emit_at(buf, len, "samples %llu\nmean_ns %llu\nmax_ns %llu\n",
+			 count, count ? div64_u64(sum_ns, count) : 0, max_ns);
+    return len;
+}
+
+static ssize_t jitter_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+    unsigned int val;
+    int retval;
+
+    if ((retval = kstrtouint(buf, 0, &val)) < 0) {
+	return retval;
+    }
+    if (val) {
+	return -EINVAL;
+    }
+    i2c_soil_sched_jitter_reset(to_i2c_soil_dev(dev));
+    return count;
+}
+static DEVICE_ATTR_RW(jitter);
+
+/* Probe progress, see probe.c */
+static ssize_t state_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+    switch (i2c_soil_probe_ready(to_i2c_soil_dev(dev))) {
+    case 0:
+	return sysfs_emit(buf, "ready\n");
+    case -EAGAIN:
+	return sysfs_emit(buf, "probing\n");
+    default:
+	return sysfs_emit(buf, "absent\n");
+    }
+}
+static DEVICE_ATTR_RO(state);
+
+static struct attribute *i2c_soil_dev_attrs[] = {
+    &dev_attr_state.attr,
+    &dev_attr_sample_period_ms.attr,
+    &dev_attr_conv_delay_us.attr,
+    &dev_attr_max_rereads.attr,
+    &dev_attr_filter_depth.attr,
+    &dev_attr_raw_dry.attr,
+    &dev_attr_raw_wet.attr,
+    &dev_attr_sim.attr,
+    &dev_attr_sim_data.attr,
+    &dev_attr_prefetch.attr,
+    &dev_attr_jitter.attr,
+    NULL,
+};
+
+static const struct attribute_group i2c_soil_dev_group = {
+    .attrs = i2c_soil_dev_attrs,
+};
+
+const struct attribute_group *i2c_soil_dev_groups[] = {
+    &i2c_soil_dev_group,
+    &i2c_soil_burst_group,
+    &i2c_soil_bench_group,
+    &i2c_soil_replay_group,
+    &i2c_soil_pump_group,
+    NULL,
+};
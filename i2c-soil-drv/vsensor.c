@@ -0,0 +1,313 @@
+/**************************************************************************
+ *
+ * vsensor.c
+ *
+ * configfs-created virtual sensors for the i2c soil moisture driver,
+ * for scale testing consumers against many sensors.
+ *
+ *   mkdir /sys/kernel/config/i2c-soil-drv/<name>
+ *
+ * creates a sensor with its own minor and device node (the node name is
+ * in the "dev" attribute), and rmdir destroys it. A virtual sensor
+ * behaves like a real one to readers (byte and record mode, periodic
+ * sampling, netlink, sysfs), but its readings come from a waveform set
+ * by the waveform, min, max and period_ms attributes, and it never
+ * touches i2c.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/i2c.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/configfs.h>
+#include <linux/idr.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/fixp-arith.h>
+#include <linux/string.h>
+
+#include "i2c-soil-drv-int.h"
+
+/* Waveform phase is in 1/I2C_SOIL_WAVE_ONE of a period */
+#define I2C_SOIL_WAVE_ONE	65536
+
+static const char * const i2c_soil_wave_names[] = {
+    [I2C_SOIL_WAVE_CONST] = "const",
+    [I2C_SOIL_WAVE_SINE] = "sine",
+    [I2C_SOIL_WAVE_SQUARE] = "square",
+    [I2C_SOIL_WAVE_TRIANGLE] = "triangle",
+    [I2C_SOIL_WAVE_SAWTOOTH] = "sawtooth",
+    [I2C_SOIL_WAVE_NOISE] = "noise",
+};
+
+/*
+ * Virtual sensors share one worker for periodic sampling, standing in
+ * for a bus. Each takes bus slot vindex out of I2C_SOIL_MAX_VDEVS, so
+ * their periodic deadlines are spread out like those of real sensors.
+ */
+static struct i2c_soil_bus i2c_soil_vbus;
+
+/* vindex allocator; sensor vindex is minor I2C_SOIL_MAX_DEVS + vindex */
+static DEFINE_IDA(i2c_soil_vsensor_ida);
+
+struct i2c_soil_vsensor
+{
+    struct config_item item;
+    struct i2c_soil_dev *p_dev;
+    int vindex;
+};
+
+static inline struct i2c_soil_vsensor *to_i2c_soil_vsensor(struct config_item *item)
+{
+    return container_of(item, struct i2c_soil_vsensor, item);
+}
+
+/*
+ * Current position on a periodic waveform, 0 (min) to I2C_SOIL_WAVE_ONE
+ * (max). The phase comes from CLOCK_MONOTONIC, so sensors with the
+ * same period stay in step with each other.
+ */
+static int i2c_soil_wave_frac(unsigned int wave, unsigned int period_ms)
+{
+    u32 rem;
+    u32 phase;
+
+    if (!period_ms) {
+	return 0;
+    }
+    div_u64_rem(ktime_to_ms(ktime_get()), period_ms, &rem);
+    phase = div_u64((u64)rem * I2C_SOIL_WAVE_ONE, period_ms);
+
+    switch (wave) {
+    case I2C_SOIL_WAVE_SINE:
+	/* fixp_sin32_rad is +/- 0x7fffffff */
+	return (fixp_sin32_rad(phase, I2C_SOIL_WAVE_ONE) >> 16) +
+	    (I2C_SOIL_WAVE_ONE / 2);
+    case I2C_SOIL_WAVE_SQUARE:
+	return (phase < (I2C_SOIL_WAVE_ONE / 2)) ? 0 : I2C_SOIL_WAVE_ONE;
+    case I2C_SOIL_WAVE_TRIANGLE:
+	return (phase < (I2C_SOIL_WAVE_ONE / 2)) ? (phase * 2) :
+	    ((I2C_SOIL_WAVE_ONE - phase) * 2);
+    case I2C_SOIL_WAVE_SAWTOOTH:
+	return phase;
+    default:
+	return 0;
+    }
+}
+
+/* Current reading of a virtual sensor, 0-255 */
+int i2c_soil_vsensor_value(struct i2c_soil_dev *p_dev)
+{
+    unsigned int wave = READ_ONCE(p_dev->wave);
+    int lo = READ_ONCE(p_dev->wave_min);
+    int hi = READ_ONCE(p_dev->wave_max);
+    int frac;
+
+    if (wave == I2C_SOIL_WAVE_NOISE) {
+	frac = get_random_u32() % (I2C_SOIL_WAVE_ONE + 1);
+    } else {
+	frac = i2c_soil_wave_frac(wave, READ_ONCE(p_dev->wave_period_ms));
+    }
+    return lo + ((hi - lo) * frac) / I2C_SOIL_WAVE_ONE;
+}
+
+static ssize_t i2c_soil_vsensor_dev_show(struct config_item *item, char *page)
+{
+    return sprintf(page, "%s\n", dev_name(&to_i2c_soil_vsensor(item)->p_dev->dev));
+}
+
+static ssize_t i2c_soil_vsensor_waveform_show(struct config_item *item,
+					      char *page)
+{
+    return sprintf(page, "%s\n",
+		   i2c_soil_wave_names[READ_ONCE(to_i2c_soil_vsensor(item)->p_dev->wave)]);
+}
+
+static ssize_t i2c_soil_vsensor_waveform_store(struct config_item *item,
+					       const char *page, size_t count)
+{
+    int wave = sysfs_match_string(i2c_soil_wave_names, page);
+
+    if (wave < 0) {
+	return wave;
+    }
+    WRITE_ONCE(to_i2c_soil_vsensor(item)->p_dev->wave, wave);
+    return count;
+}
+
+/* min and max are 0-255; max < min just inverts the waveform */
+#define I2C_SOIL_VSENSOR_ATTR(_name, _field, _max)			\
+static ssize_t i2c_soil_vsensor_##_name##_show(struct config_item *item, \
+					       char *page)		\
+{									\
+    return sprintf(page, "%u\n",					\
+		   READ_ONCE(to_i2c_soil_vsensor(item)->p_dev->_field)); \
+}									\
+static ssize_t i2c_soil_vsensor_##_name##_store(struct config_item *item, \
+						const char *page,	\
+						size_t count)		\
+{									\
+    unsigned int val;							\
+    int retval;								\
+									\
+    if ((retval = kstrtouint(page, 0, &val)) < 0) {			\
+	return retval;							\
+    }									\
+    if (val > (_max)) {							\
+	return -EINVAL;							\
+    }									\
+    WRITE_ONCE(to_i2c_soil_vsensor(item)->p_dev->_field, val);		\
+    return count;							\
+}
+
+I2C_SOIL_VSENSOR_ATTR(min, wave_min, I2C_MAX_WET_READING);
+I2C_SOIL_VSENSOR_ATTR(max, wave_max, I2C_MAX_WET_READING);
+I2C_SOIL_VSENSOR_ATTR(period_ms, wave_period_ms, UINT_MAX);
+
+CONFIGFS_ATTR_RO(i2c_soil_vsensor_, dev);
+CONFIGFS_ATTR(i2c_soil_vsensor_, waveform);
+CONFIGFS_ATTR(i2c_soil_vsensor_, min);
+CONFIGFS_ATTR(i2c_soil_vsensor_, max);
+CONFIGFS_ATTR(i2c_soil_vsensor_, period_ms);
+
+static struct configfs_attribute *i2c_soil_vsensor_attrs[] = {
+    &i2c_soil_vsensor_attr_dev,
+    &i2c_soil_vsensor_attr_waveform,
+    &i2c_soil_vsensor_attr_min,
+    &i2c_soil_vsensor_attr_max,
+    &i2c_soil_vsensor_attr_period_ms,
+    NULL,
+};
+
+/* Last reference to the configfs item; the sensor is already gone */
+static void i2c_soil_vsensor_release(struct config_item *item)
+{
+    kfree(to_i2c_soil_vsensor(item));
+}
+
+static struct configfs_item_operations i2c_soil_vsensor_item_ops = {
+    .release = i2c_soil_vsensor_release,
+};
+
+static const struct config_item_type i2c_soil_vsensor_type = {
+    .ct_item_ops = &i2c_soil_vsensor_item_ops,
+    .ct_attrs = i2c_soil_vsensor_attrs,
+    .ct_owner = THIS_MODULE,
+};
+
+/* mkdir: create and register the sensor, a sine from dry to wet */
+static struct config_item *i2c_soil_vsensor_make_item(struct config_group *group,
+						      const char *name)
+{
+    struct i2c_soil_vsensor *p_vsensor;
+    struct i2c_soil_dev *p_dev;
+    int retval;
+
+    p_vsensor = kzalloc(sizeof(struct i2c_soil_vsensor), GFP_KERNEL);
+    if (!p_vsensor) {
+	return ERR_PTR(-ENOMEM);
+    }
+
+    p_vsensor->vindex = ida_alloc_max(&i2c_soil_vsensor_ida,
+				      I2C_SOIL_MAX_VDEVS - 1, GFP_KERNEL);
+    if (p_vsensor->vindex < 0) {
+	retval = p_vsensor->vindex;
+	goto ida_alloc_failed;
+    }
+
+    p_dev = i2c_soil_drv_alloc_dev(I2C_SOIL_MAX_DEVS + p_vsensor->vindex);
+    if (IS_ERR(p_dev)) {
+	retval = PTR_ERR(p_dev);
+	goto alloc_dev_failed;
+    }
+    p_dev->virtual_dev = 1;
+    p_dev->probe_state = I2C_SOIL_PROBE_READY;
+    p_dev->wave = I2C_SOIL_WAVE_SINE;
+    p_dev->wave_min = I2C_MIN_DRY_READING;
+    p_dev->wave_max = I2C_MAX_WET_READING;
+    p_dev->wave_period_ms = 60 * MSEC_PER_SEC;
+    p_dev->p_bus = &i2c_soil_vbus;
+    p_dev->bus_slot = p_vsensor->vindex;
+
+    if ((retval = i2c_soil_drv_add_dev(p_dev)) < 0) {
+	goto add_dev_failed;
+    }
+    i2c_soil_sched_start(p_dev);
+
+    p_vsensor->p_dev = p_dev;
+    config_item_init_type_name(&p_vsensor->item, name, &i2c_soil_vsensor_type);
+    return &p_vsensor->item;
+
+add_dev_failed:
+    put_device(&p_dev->dev);
+alloc_dev_failed:
+    ida_free(&i2c_soil_vsensor_ida, p_vsensor->vindex);
+ida_alloc_failed:
+    kfree(p_vsensor);
+    return ERR_PTR(retval);
+}
+
+/* rmdir: open files keep the device memory until they are closed */
+static void i2c_soil_vsensor_drop_item(struct config_group *group,
+				       struct config_item *item)
+{
+    struct i2c_soil_vsensor *p_vsensor = to_i2c_soil_vsensor(item);
+
+    i2c_soil_drv_destroy_dev(p_vsensor->p_dev);
+    ida_free(&i2c_soil_vsensor_ida, p_vsensor->vindex);
+    config_item_put(item);
+}
+
+static struct configfs_group_operations i2c_soil_vsensors_group_ops = {
+    .make_item = i2c_soil_vsensor_make_item,
+    .drop_item = i2c_soil_vsensor_drop_item,
+};
+
+static const struct config_item_type i2c_soil_vsensors_type = {
+    .ct_group_ops = &i2c_soil_vsensors_group_ops,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem i2c_soil_vsensors_subsys = {
+    .su_group = {
+	.cg_item = {
+	    .ci_namebuf = "i2c-soil-drv",
+	    .ci_type = &i2c_soil_vsensors_type,
+	},
+    },
+};
+
+/*
+ * Virtual sensors each hold a module reference through configfs, so
+ * none can exist by the time i2c_soil_vsensor_cleanup runs.
+ */
+int i2c_soil_vsensor_init(void)
+{
+    int retval;
+
+    i2c_soil_vbus.bus_num = -1;
+    i2c_soil_vbus.num_devs = I2C_SOIL_MAX_VDEVS;
+    spin_lock_init(&i2c_soil_vbus.stats_lock);
+    i2c_soil_vbus.stats_start = ktime_get();
+    i2c_soil_vbus.p_worker = kthread_create_worker(0, "i2c-soil/virt");
+    if (IS_ERR(i2c_soil_vbus.p_worker)) {
+	return PTR_ERR(i2c_soil_vbus.p_worker);
+    }
+
+    config_group_init(&i2c_soil_vsensors_subsys.su_group);
+    mutex_init(&i2c_soil_vsensors_subsys.su_mutex);
+    if ((retval = configfs_register_subsystem(&i2c_soil_vsensors_subsys)) < 0) {
+	kthread_destroy_worker(i2c_soil_vbus.p_worker);
+    }
+    return retval;
+}
+
+void i2c_soil_vsensor_cleanup(void)
+{
+    configfs_unregister_subsystem(&i2c_soil_vsensors_subsys);
+    kthread_destroy_worker(i2c_soil_vbus.p_worker);
+}
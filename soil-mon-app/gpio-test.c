@@ -28,15 +28,15 @@ int main()
     printf("GPIO_DIRECTORY: %s\n", GPIO_DIRECTORY);
     printf("GPIO_EXPORT: %s\n", GPIO_EXPORT);
     printf("GPIO_UNEXPORT: %s\n", GPIO_UNEXPORT);
-    printf("GPIO_DIRECTION: %s\n", GPIO_DIRECTION);
+    printf("GPIO_DIRECTION: " GPIO_DIRECTION "\n", GPIO_PIN);
     printf("GPIO_OUTPUT: %s\n", GPIO_OUTPUT);
     printf("GPIO_INPUT: %s\n", GPIO_INPUT);
-    printf("GPIO_VALUE: %s\n", GPIO_VALUE);
+    printf("GPIO_VALUE: " GPIO_VALUE "\n", GPIO_PIN);
     printf("GPIO_ON: %s\n", GPIO_ON);
     printf("GPIO_OFF: %s\n", GPIO_OFF);
 
     printf("\ngpio_enable(): ");
-    if (gpio_enable()) {
+    if (gpio_enable(GPIO_PIN)) {
 	perror("");
 	exit(EXIT_FAILURE);
     }
@@ -45,14 +45,14 @@ int main()
     printf("\nTest 5 turn on/off with 2 second delay.\n");
     for (int i=0; i<5; i++) {
 	printf("gpio_on(): ");
-	if(gpio_on()) {
+	if(gpio_on(GPIO_PIN)) {
 	    perror("");
 	    exit(EXIT_FAILURE);
 	}
 	printf("Success\n");
 	sleep(2);
 	printf("gpio_off(): ");
-	if(gpio_off()) {
+	if(gpio_off(GPIO_PIN)) {
 	    perror("");
 	    exit(EXIT_FAILURE);
 	}
@@ -62,14 +62,14 @@ int main()
     /* Turn on before disable - disable should shut off */
     printf("\nFinal turn on before disable.\n");
     printf("gpio_on(): ");
-    if(gpio_on()) {
+    if(gpio_on(GPIO_PIN)) {
 	perror("");
 	exit(EXIT_FAILURE);
     }
     printf("Success\n");
     sleep(2);
     printf("gpio_disable(), should shut off output: ");
-    if(gpio_disable()) {
+    if(gpio_disable(GPIO_PIN)) {
 	perror("");
 	exit(EXIT_FAILURE);
     }
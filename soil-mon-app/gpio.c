@@ -17,30 +17,32 @@
 #include "gpio.h"
 
 /*
- * Write the GPIO export file in sysfs to enable our pin and set
- * it as an output.
+ * Write the GPIO export file in sysfs to enable pin (eg GPIO_PIN) and
+ * set it as an output.
  *
  * Returns GPIO_OK on success, GPIO_ERROR on faliure.
  *
  * Note, repeat calls will fail - write will fail on second and
  * subsequent calls (ie, can't export a currently-exported pin).
  */
-int gpio_enable(void)
+int gpio_enable(const char *pin)
 {
+    char path[GPIO_PATH_MAX];
     int fd;
     int num_bytes;
 
     /* Export enables control, creates additional gpio pin entries in sysfs */
-    num_bytes = strlen(GPIO_PIN);
+    num_bytes = strlen(pin);
     if (((fd = open(GPIO_EXPORT, O_WRONLY)) == -1) ||
-	(write(fd, GPIO_PIN, num_bytes) != num_bytes) ||
+	(write(fd, pin, num_bytes) != num_bytes) ||
 	close(fd)) {
 	return GPIO_ERROR;
     }
 
     /* Set pin as output */
+    snprintf(path, sizeof(path), GPIO_DIRECTION, pin);
     num_bytes = strlen(GPIO_OUTPUT);
-    if (((fd = open(GPIO_DIRECTION, O_WRONLY)) == -1) ||
+    if (((fd = open(path, O_WRONLY)) == -1) ||
 	(write(fd, GPIO_OUTPUT, num_bytes) != num_bytes) ||
 	close(fd)) {
 	return GPIO_ERROR;
@@ -51,30 +53,32 @@ int gpio_enable(void)
 
 /*
  * Set the pin as an input (to shut off drive) and Write the GPIO
- * unexport file in sysfs to disable our pin.
+ * unexport file in sysfs to disable pin.
  *
  * Returns GPIO_OK on success, GPIO_ERROR on faliure.
  *
  * Note, repeat calls will fail - write will fail on second and
  * subsequent calls (ie, can't unexport a not-exported pin).
  */
-int gpio_disable(void)
+int gpio_disable(const char *pin)
 {
+    char path[GPIO_PATH_MAX];
     int fd;
     int num_bytes;
 
     /* Setting pin as an input disables drive, regardless of current state */
+    snprintf(path, sizeof(path), GPIO_DIRECTION, pin);
     num_bytes = strlen(GPIO_INPUT);
-    if (((fd = open(GPIO_DIRECTION, O_WRONLY)) == -1) ||
+    if (((fd = open(path, O_WRONLY)) == -1) ||
 	(write(fd, GPIO_INPUT, num_bytes) != num_bytes) ||
 	close(fd)) {
 	return GPIO_ERROR;
     }
 
     /* Unexport disables control, removes gpio pin entries from sysfs */
-    num_bytes = strlen(GPIO_PIN);
+    num_bytes = strlen(pin);
     if (((fd = open(GPIO_UNEXPORT, O_WRONLY)) == -1) ||
-	(write(fd, GPIO_PIN, num_bytes) != num_bytes) ||
+	(write(fd, pin, num_bytes) != num_bytes) ||
 	close(fd)) {
 	return GPIO_ERROR;
     }
@@ -89,14 +93,16 @@ int gpio_disable(void)
  *
  * Will fail if pin is not exported already.
  */
-int gpio_on(void)
+int gpio_on(const char *pin)
 {
+    char path[GPIO_PATH_MAX];
     int fd;
     int num_bytes;
 
     /* Write 1, set pin high */
+    snprintf(path, sizeof(path), GPIO_VALUE, pin);
     num_bytes = strlen(GPIO_ON);
-    if (((fd = open(GPIO_VALUE, O_WRONLY)) == -1) ||
+    if (((fd = open(path, O_WRONLY)) == -1) ||
 	(write(fd, GPIO_ON, num_bytes) != num_bytes) ||
 	close(fd)) {
 	return GPIO_ERROR;
@@ -112,14 +118,16 @@ int gpio_on(void)
  *
  * Will fail if pin is not exported already.
  */
-int gpio_off(void)
+int gpio_off(const char *pin)
 {
+    char path[GPIO_PATH_MAX];
     int fd;
     int num_bytes;
 
     /* Write 0, set pin low */
+    snprintf(path, sizeof(path), GPIO_VALUE, pin);
     num_bytes = strlen(GPIO_OFF);
-    if (((fd = open(GPIO_VALUE, O_WRONLY)) == -1) ||
+    if (((fd = open(path, O_WRONLY)) == -1) ||
 	(write(fd, GPIO_OFF, num_bytes) != num_bytes) ||
 	close(fd)) {
 	return GPIO_ERROR;
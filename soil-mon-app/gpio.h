@@ -10,40 +10,42 @@
 #ifndef GPIO_H
 #define GPIO_H
 
-#define GPIO_PIN	"17"
+#define GPIO_PIN	"17"	/* Default pump pin */
 #define GPIO_DIRECTORY	"/sys/class/gpio"
 #define GPIO_EXPORT	GPIO_DIRECTORY "/export"
 #define GPIO_UNEXPORT	GPIO_DIRECTORY "/unexport"
-#define GPIO_DIRECTION	GPIO_DIRECTORY "/gpio" GPIO_PIN "/direction"
+/* Per-pin files, printf formats taking the pin */
+#define GPIO_DIRECTION	GPIO_DIRECTORY "/gpio%s/direction"
 #define GPIO_INPUT	"in"
 #define GPIO_OUTPUT	"out"
-#define GPIO_VALUE	GPIO_DIRECTORY "/gpio" GPIO_PIN "/value"
+#define GPIO_VALUE	GPIO_DIRECTORY "/gpio%s/value"
+#define GPIO_PATH_MAX	64
 #define GPIO_ON		"1"
 #define GPIO_OFF	"0"
 #define GPIO_ERROR	-1
 #define GPIO_OK		0
 
 /*
- * Write the GPIO export file in sysfs to enable our pin and set
- * it as an output.
+ * Write the GPIO export file in sysfs to enable pin (eg GPIO_PIN) and
+ * set it as an output.
  *
  * Returns GPIO_OK on success, GPIO_ERROR on faliure.
  *
  * Note, repeat calls will fail - write will fail on second and
  * subsequent calls (ie, can't export a currently-exported pin).
  */
-int gpio_enable(void);
+int gpio_enable(const char *pin);
 
 /*
  * Set the pin as an input (to shut off drive) and Write the GPIO
- * unexport file in sysfs to disable our pin.
+ * unexport file in sysfs to disable pin.
  *
  * Returns GPIO_OK on success, GPIO_ERROR on faliure.
  *
  * Note, repeat calls will fail - write will fail on second and
  * subsequent calls (ie, can't unexport a not-exported pin).
  */
-int gpio_disable(void);
+int gpio_disable(const char *pin);
 
 /*
  * Turn on the already-exported pin.
@@ -52,7 +54,7 @@ int gpio_disable(void);
  *
  * Will fail if pin is not exported already.
  */
-int gpio_on(void);
+int gpio_on(const char *pin);
 
 /*
  * Turn off the already-exported pin.
@@ -61,6 +63,6 @@ int gpio_on(void);
  *
  * Will fail if pin is not exported already.
  */
-int gpio_off(void);
+int gpio_off(const char *pin);
 
 #endif /* GPIO_H */
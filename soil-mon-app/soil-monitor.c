@@ -17,6 +17,12 @@
 #include <signal.h>
 #include <syslog.h>
 #include <libgen.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include "MQTTClient.h"
 
@@ -41,6 +47,60 @@
 /* Pump run time (seconds). Overriddent by -p */
 #define PUMP_TIME		5
 
+/* Most zones (sensor and pump pairs) one daemon runs, -z options */
+#define MAX_ZONES		8
+
+/*
+ * Event sources in the main loop's epoll set, in epoll_event.data.u32:
+ * EV_* in the low byte, the zone index above it.
+ */
+#define EV_SIGNAL		0 /* signalfd */
+#define EV_SAMPLE		1 /* Sample timerfd, wall clock multiples of sleep_time */
+#define EV_PUMP			2 /* Pump timerfd, pump_time after pump on */
+#define EV_SENSOR		3 /* Sensor fd, reading done */
+#define EV_SOURCE_MASK		0xff
+#define EV_ZONE_SHIFT		8
+#define MAX_EVENTS		(1 + 3 * MAX_ZONES) /* signalfd, 3 per zone */
+
+/*
+ * One sensor and the pump watering the same soil. Each zone has its
+ * own fds, target and timing, so zones are read and watered
+ * independently of each other.
+ */
+struct zone
+{
+    int index;			/* In monitor.zones, for log messages */
+    const char *dev;		/* Sensor device, eg I2C_SOIL_DEV */
+    const char *pin;		/* Pump gpio, eg GPIO_PIN */
+    unsigned char target;	/* Pump on below this moisture level */
+    int sleep_time;		/* Seconds between readings */
+    int pump_time;		/* Seconds per pump run */
+    int soil_drv_fd;		/* Sensor, non-blocking */
+    int sample_timer_fd;
+    int pump_timer_fd;
+    int gpio_enabled;		/* 1=gpio_disable on exit */
+    int reading;		/* 1=acquisition started, waiting on the fd */
+    int pump_on;		/* 1=pump running */
+};
+
+/*
+ * Everything the main loop works on. MQTT isn't in the epoll set: the
+ * paho MQTTClient library runs its socket on its own thread and
+ * doesn't expose it. Publishing at QoS 0 doesn't wait on the broker,
+ * and reconnects run on that thread (mqtt_connection_lost), so it never
+ * holds up the loop either.
+ */
+struct monitor
+{
+    const char *argv0;		/* For perror */
+    int epoll_fd;
+    int signal_fd;
+    struct zone zones[MAX_ZONES];
+    int num_zones;
+    MQTTClient mqtt_client;	/* NULL=MQTT disabled */
+    char *msgbuf;		/* MQTT_MSG_BUFSIZE, for log_msg */
+};
+
 /*
  * Print usage to stderr. Arg is program name (ie, argv[0]).
  *
@@ -48,30 +108,72 @@
  */
 void print_usage(const char* argv0)
 {
-    fprintf(stderr, "Usage: %s [-s -t <target_moisture>]\n", argv0);
+    fprintf(stderr, "Usage: %s [-s -t <target_moisture> -z <zone>...]\n", argv0);
     fprintf(stderr,"   -s : Turn on simulation mode in soil moisture sensor driver\n");
     fprintf(stderr,"        (default is off).\n");
     fprintf(stderr,"   -t <target_moisture> : Set target moisture level, 0-255.\n");
     fprintf(stderr,"        (default is %d).\n", DEFAULT_MOISTURE_TARGET);
-    fprintf(stderr,"   -w <wait_time> : Set wait time in seconds between readings.\n");
+    fprintf(stderr,"   -w <wait_time> : Set wait time in seconds between readings,\n");
+    fprintf(stderr,"        taken on wall clock multiples of it, eg 3600=on the hour\n");
     fprintf(stderr,"        (default is %d).\n", SLEEP_TIME);
     fprintf(stderr,"   -p <pump_run_time> : Set pump run time in seconds (default is %d).\n", PUMP_TIME);
+    fprintf(stderr,"   -z <dev>[:<gpio>[:<target_moisture>[:<pump_run_time>[:<wait_time>]]]] :\n");
+    fprintf(stderr,"        Add a zone, a sensor and the pump on gpio <gpio>, up to %d.\n", MAX_ZONES);
+    fprintf(stderr,"        Empty or missing fields default to %s, gpio %s and\n",
+	    I2C_SOIL_DEV, GPIO_PIN);
+    fprintf(stderr,"        the -t, -p and -w values (default is one such zone).\n");
     fprintf(stderr,"   -m <broker_URI> : Publish MQTT messages to broker <broker_URI>\n");
     fprintf(stderr,"        (default is off).\n");
 }
 
+/*
+ * Fill in p_zone from a -z spec, "<dev>:<gpio>:<target>:<pump_time>:
+ * <sleep_time>" with trailing fields optional, splitting spec in place.
+ * Empty or missing fields take the defaults passed in. Returns 0, or
+ * -1 if spec is malformed.
+ */
+int parse_zone(struct zone *p_zone, char *spec, unsigned char target,
+	       int sleep_time, int pump_time)
+{
+    char *fields[5] = { NULL };
+
+    for (int i = 0; spec && (i < 5); i++) {
+	if (*(fields[i] = strsep(&spec, ":")) == '\0') {
+	    fields[i] = NULL;
+	}
+    }
+    if (spec) {
+	return -1; /* Too many fields */
+    }
+
+    p_zone->dev = fields[0] ? fields[0] : I2C_SOIL_DEV;
+    p_zone->pin = fields[1] ? fields[1] : GPIO_PIN;
+    p_zone->target = fields[2] ? atoi(fields[2]) : target;
+    p_zone->pump_time = fields[3] ? atoi(fields[3]) : pump_time;
+    p_zone->sleep_time = fields[4] ? atoi(fields[4]) : sleep_time;
+
+    /* Readings are aligned on multiples of sleep_time */
+    return (p_zone->sleep_time < 1) ? -1 : 0;
+}
+
 /*
  * Call getopts to parse the command line args in argc/argv and fill
- * in the various parameters passed as call-by-reference.
+ * in the various parameters passed as call-by-reference, and p_mon's
+ * zones. -t, -w and -p are the defaults for every zone, wherever they
+ * are on the command line.
  */
 void parse_options(int argc, char *argv[], int *daemonize, const char **sim_cmd,
-		   unsigned char *target, int *sleep_time, int *pump_time,
-		   char **mqtt_broker_uri)
+		   struct monitor *p_mon, char **mqtt_broker_uri)
 {
+    char *zone_specs[MAX_ZONES];
+    int num_zone_specs = 0;
+    unsigned char target = DEFAULT_MOISTURE_TARGET;
+    int sleep_time = SLEEP_TIME;
+    int pump_time = PUMP_TIME;
     int opt;
 
     /* Parse options -s, -t xx, and -? */
-    while ((opt = getopt(argc, argv, "fst:w:p:m:?")) != -1) {
+    while ((opt = getopt(argc, argv, "fst:w:p:z:m:?")) != -1) {
 	switch (opt) {
 	case 'f':
 	    *daemonize = 0; /* run in foreground */
@@ -80,13 +182,20 @@ void parse_options(int argc, char *argv[], int *daemonize, const char **sim_cmd,
 	    *sim_cmd = SIM_ON_CMD;
 	    break;
 	case 't':
-	    *target = atoi(optarg);
+	    target = atoi(optarg);
 	    break;
 	case 'w':
-	    *sleep_time = atoi(optarg);
+	    sleep_time = atoi(optarg);
 	    break;
 	case 'p':
-	    *pump_time = atoi(optarg);
+	    pump_time = atoi(optarg);
+	    break;
+	case 'z':
+	    if (num_zone_specs == MAX_ZONES) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	    }
+	    zone_specs[num_zone_specs++] = optarg;
 	    break;
 	case 'm':
 	    if (*mqtt_broker_uri = malloc(strlen(optarg)+1)) { /* +1=space for \0 */
@@ -99,40 +208,45 @@ void parse_options(int argc, char *argv[], int *daemonize, const char **sim_cmd,
 	    exit(EXIT_FAILURE);
 	}
     }
-}
 
-/*
- * Catch SIGINT (ctrl-c) and SIGTERM, cleanup and exit
- * Only cleanup needed is to un-export the GPIO pin and exit.
- */
-void signal_handler(int signal)
-{
-    if (SIGUSR1 == signal) {
-	/* Do nothing, sleep will return early */
-    } else {
-	/* Exit on all others */
-	syslog(LOG_USER|LOG_INFO, "Caught signal %s, exiting.\n",
-	       ((SIGINT == signal) ? "SIGINT" :
-		((SIGTERM == signal) ? "SIGTERM" : "UNKNOWN")));
+    /* No -z: one zone on the default sensor and pump, as before zones */
+    if (!num_zone_specs) {
+	zone_specs[num_zone_specs++] = NULL;
+    }
 
-	/* Disable GPIO control - ignore errors, since we are exiting anyway */
-	(void) gpio_disable();
-	exit(EXIT_SUCCESS);
+    for (int i = 0; i < num_zone_specs; i++) {
+	p_mon->zones[i].index = i;
+	if (parse_zone(&p_mon->zones[i], zone_specs[i], target,
+		       sleep_time, pump_time)) {
+	    print_usage(argv[0]);
+	    exit(EXIT_FAILURE);
+	}
     }
+    p_mon->num_zones = num_zone_specs;
 }
 
 /*
- * Install signal handler to catch SIGINT (ctrl-c) and SIGTERM.
- * Argument is argv[0] for perror. Returns nothing.
+ * Block SIGINT (ctrl-c), SIGTERM and SIGUSR1, and return a signalfd
+ * that reads them, so they're handled in the main loop like any other
+ * event, where syslog and gpio cleanup are safe. Call before any
+ * threads are created (MQTT), so they inherit the mask. Argument is
+ * argv[0] for perror.
  */
-void init_signal_handlers(const char *argv0)
+int init_signal_handlers(const char *argv0)
 {
-    if ((signal(SIGINT, signal_handler) == SIG_ERR) ||
-	(signal(SIGTERM, signal_handler) == SIG_ERR) ||
-	(signal(SIGUSR1, signal_handler) == SIG_ERR)) {
+    sigset_t mask;
+    int signal_fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    if ((sigprocmask(SIG_BLOCK, &mask, NULL) == -1) ||
+	((signal_fd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1)) {
 	perror(argv0);
 	exit(EXIT_FAILURE);
     }
+    return signal_fd;
 }
 
 /*
@@ -301,24 +415,306 @@ void mqtt_publish_msg(const char *argv0, MQTTClient mqtt_client,
     }
 }
 
+/* Log msgbuf to syslog, and publish it too if MQTT is on */
+void send_msg(struct monitor *p_mon)
+{
+    syslog(LOG_USER|LOG_INFO, "%s", p_mon->msgbuf);
+    if (p_mon->mqtt_client) {
+	mqtt_publish_msg(p_mon->argv0, p_mon->mqtt_client, p_mon->msgbuf);
+    }
+}
+
+/*
+ * Log a message to syslog, and publish it too if MQTT is on. Takes
+ * printf style arguments.
+ */
+void log_msg(struct monitor *p_mon, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(p_mon->msgbuf, MQTT_MSG_BUFSIZE, fmt, args);
+    va_end(args);
+    send_msg(p_mon);
+}
+
+/*
+ * log_msg for one zone's event. With several zones the message starts
+ * "Zone N: "; with one, it's the text soil-monitor always sent, so
+ * existing MQTT subscribers keep parsing it.
+ */
+void zone_msg(struct monitor *p_mon, struct zone *p_zone, const char *fmt, ...)
+{
+    va_list args;
+    int len = 0;
+
+    if (p_mon->num_zones > 1) {
+	len = snprintf(p_mon->msgbuf, MQTT_MSG_BUFSIZE, "Zone %d: ",
+		       p_zone->index);
+    }
+    va_start(args, fmt);
+    vsnprintf(p_mon->msgbuf + len, MQTT_MSG_BUFSIZE - len, fmt, args);
+    va_end(args);
+    send_msg(p_mon);
+}
+
+/* Disable GPIO control of every zone's pump - ignore errors; exiting anyway */
+void release_pumps(struct monitor *p_mon)
+{
+    for (int i = 0; i < p_mon->num_zones; i++) {
+	if (p_mon->zones[i].gpio_enabled) {
+	    (void) gpio_disable(p_mon->zones[i].pin);
+	}
+    }
+}
+
+/* perror, release the pumps and exit; for errors the loop can't go on from */
+void fatal(struct monitor *p_mon)
+{
+    perror(p_mon->argv0);
+    release_pumps(p_mon);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Arm timerfd fd to expire in secs seconds, then every interval
+ * seconds (0=once).
+ */
+void arm_timer(struct monitor *p_mon, int fd, int secs, int interval)
+{
+    struct itimerspec its = {
+	.it_value = { .tv_sec = secs },
+	.it_interval = { .tv_sec = interval },
+    };
+
+    /* An all zero it_value disarms; 0 secs means expire at once */
+    if (!secs) {
+	its.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+	fatal(p_mon);
+    }
+}
+
+/*
+ * Arm a zone's sample timer for wall clock multiples of its
+ * sleep_time, eg on the hour for 3600 (for periods that divide a day,
+ * in UTC), so every unit's readings line up. Deadlines are absolute,
+ * so neither the work done for a reading nor loop latency shifts the
+ * next one. Setting the clock (NTP at boot, with no RTC) cancels the
+ * timer; the loop then calls this again to realign.
+ */
+void arm_sample_timer(struct monitor *p_mon, struct zone *p_zone)
+{
+    struct itimerspec its = {
+	.it_interval = { .tv_sec = p_zone->sleep_time },
+    };
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
+	fatal(p_mon);
+    }
+    its.it_value.tv_sec = (now.tv_sec / p_zone->sleep_time + 1) * p_zone->sleep_time;
+    if (timerfd_settime(p_zone->sample_timer_fd,
+			TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) == -1) {
+	fatal(p_mon);
+    }
+}
+
+/*
+ * Consume a timerfd's expirations, so epoll stops reporting it.
+ * Returns 0, or -1 if the clock was set (ECANCELED, sample timer only).
+ */
+int ack_timer(struct monitor *p_mon, int fd)
+{
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) == -1) {
+	if (errno == ECANCELED) {
+	    return -1;
+	} else if (errno != EAGAIN) {
+	    fatal(p_mon);
+	}
+    }
+    return 0;
+}
+
+/* Act on a zone's moisture reading: start its pump if too dry */
+void handle_reading(struct monitor *p_mon, struct zone *p_zone,
+		    unsigned char current)
+{
+    zone_msg(p_mon, p_zone, "Current moisture=%d\n", current);
+
+    if ((current < p_zone->target) && !p_zone->pump_on) {
+	if (gpio_on(p_zone->pin) == GPIO_ERROR) {
+	    fatal(p_mon);
+	}
+	p_zone->pump_on = 1;
+	arm_timer(p_mon, p_zone->pump_timer_fd, p_zone->pump_time, 0);
+	zone_msg(p_mon, p_zone, "Pump on, runtime=%d sec\n", p_zone->pump_time);
+    }
+}
+
+/*
+ * Read a zone's sensor without blocking. The first read of a sample
+ * starts the acquisition and fails with EAGAIN; the fd then polls
+ * readable once it is done, and the loop calls this again to collect
+ * it.
+ */
+void read_sensor(struct monitor *p_mon, struct zone *p_zone)
+{
+    unsigned char current;
+
+    if (read(p_zone->soil_drv_fd, &current, sizeof(current)) == sizeof(current)) {
+	p_zone->reading = 0;
+	handle_reading(p_mon, p_zone, current);
+    } else if (errno == EAGAIN) {
+	p_zone->reading = 1;
+    } else {
+	fatal(p_mon);
+    }
+}
+
+/* Add fd to the loop's epoll set, tagged with EV_* source and zone index */
+void watch_fd(struct monitor *p_mon, int fd, uint32_t source, int zone)
+{
+    struct epoll_event ev = {
+	.events = EPOLLIN,
+	.data.u32 = ((uint32_t)zone << EV_ZONE_SHIFT) | source,
+    };
+
+    if (epoll_ctl(p_mon->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	fatal(p_mon);
+    }
+}
+
+/*
+ * Open a zone's sensor, put it in sim_cmd mode, take control of its
+ * pump, and add its fds to the loop. Once any pump is enabled, errors
+ * go through fatal, which releases them.
+ */
+void init_zone(struct monitor *p_mon, struct zone *p_zone, const char *sim_cmd)
+{
+    /* Non-blocking: the loop waits for readings in epoll, not in read */
+    if ((p_zone->soil_drv_fd = open(p_zone->dev, O_RDWR | O_NONBLOCK)) == -1) {
+	fatal(p_mon);
+    }
+
+    /* Set sim mode so we are in a known state */
+    if (write(p_zone->soil_drv_fd, sim_cmd, strlen(sim_cmd)) != (ssize_t)strlen(sim_cmd)) {
+	fatal(p_mon);
+    }
+
+    /* Enable GPIO control - Any subsequent exits should call gpio_disable() */
+    if (gpio_enable(p_zone->pin) == GPIO_ERROR) {
+	fatal(p_mon);
+    }
+    p_zone->gpio_enabled = 1;
+
+    if (((p_zone->sample_timer_fd = timerfd_create(CLOCK_REALTIME,
+						   TFD_NONBLOCK | TFD_CLOEXEC)) == -1) ||
+	((p_zone->pump_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						 TFD_NONBLOCK | TFD_CLOEXEC)) == -1)) {
+	fatal(p_mon);
+    }
+    watch_fd(p_mon, p_zone->sample_timer_fd, EV_SAMPLE, p_zone->index);
+    watch_fd(p_mon, p_zone->pump_timer_fd, EV_PUMP, p_zone->index);
+    watch_fd(p_mon, p_zone->soil_drv_fd, EV_SENSOR, p_zone->index);
+}
+
+/*
+ * The main loop: wait for the next event, on any zone, and handle it,
+ * never sleeping in between, so a sample falling due while a pump runs
+ * (or the other way round, or on another zone) is handled on time.
+ * Doesn't return.
+ */
+void run_loop(struct monitor *p_mon)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct signalfd_siginfo si;
+    struct zone *p_zone;
+    int num_events;
+
+    while (1) {
+	if ((num_events = epoll_wait(p_mon->epoll_fd, events, MAX_EVENTS, -1)) == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    fatal(p_mon);
+	}
+
+	for (int i = 0; i < num_events; i++) {
+	    p_zone = &p_mon->zones[events[i].data.u32 >> EV_ZONE_SHIFT];
+	    switch (events[i].data.u32 & EV_SOURCE_MASK) {
+	    case EV_SIGNAL:
+		if (read(p_mon->signal_fd, &si, sizeof(si)) != sizeof(si)) {
+		    fatal(p_mon);
+		}
+		if (SIGUSR1 == si.ssi_signo) {
+		    /* Take a reading in every zone now */
+		    for (int z = 0; z < p_mon->num_zones; z++) {
+			if (!p_mon->zones[z].reading) {
+			    read_sensor(p_mon, &p_mon->zones[z]);
+			}
+		    }
+		    break;
+		}
+		syslog(LOG_USER|LOG_INFO, "Caught signal %s, exiting.\n",
+		       ((SIGINT == si.ssi_signo) ? "SIGINT" :
+			((SIGTERM == si.ssi_signo) ? "SIGTERM" : "UNKNOWN")));
+		release_pumps(p_mon);
+		exit(EXIT_SUCCESS);
+	    case EV_SAMPLE:
+		if (ack_timer(p_mon, p_zone->sample_timer_fd)) {
+		    zone_msg(p_mon, p_zone, "Clock set, realigning readings\n");
+		    arm_sample_timer(p_mon, p_zone);
+		    break;
+		}
+		/*
+		 * A reading still in flight a whole period on was lost
+		 * (or its wakeup was): say so and read again, rather
+		 * than leave the zone unwatered. The read is
+		 * non-blocking, and collects the sample if it's there.
+		 */
+		if (p_zone->reading) {
+		    zone_msg(p_mon, p_zone, "Reading overdue, retrying\n");
+		}
+		read_sensor(p_mon, p_zone);
+		zone_msg(p_mon, p_zone, "Sleeping for %d sec\n",
+			 p_zone->sleep_time);
+		break;
+	    case EV_PUMP:
+		ack_timer(p_mon, p_zone->pump_timer_fd);
+		if (gpio_off(p_zone->pin) == GPIO_ERROR) {
+		    fatal(p_mon);
+		}
+		p_zone->pump_on = 0;
+		zone_msg(p_mon, p_zone, "Pump off\n");
+		break;
+	    case EV_SENSOR:
+		/* Reading done, or failed (EPOLLERR): read says which */
+		read_sensor(p_mon, p_zone);
+		break;
+	    }
+	}
+    }
+}
+
 int main(int argc, char *argv[])
 {
     /* Defaults for options */
     const char *sim_cmd = SIM_OFF_CMD;
     int daemonize = 1; /* default is to run as deamon w/out -f */
-    unsigned char target = DEFAULT_MOISTURE_TARGET;
-    int sleep_time = SLEEP_TIME;
-    int pump_time = PUMP_TIME;
     char *mqtt_broker_uri = NULL;
-    int soil_drv_fd;
-    MQTTClient mqtt_client = NULL;
-    char *msgbuf = NULL;
-    unsigned char current;
+    struct monitor mon = {
+	.argv0 = argv[0],
+    };
+    struct zone *p_zone;
 
-    parse_options(argc, argv, &daemonize, &sim_cmd, &target,
-		  &sleep_time, &pump_time, &mqtt_broker_uri);
+    parse_options(argc, argv, &daemonize, &sim_cmd, &mon, &mqtt_broker_uri);
 
-    init_signal_handlers(argv[0]);
+    mon.signal_fd = init_signal_handlers(argv[0]);
 
     /*
      * Daemonize before init_logging so getpid returns the correct value
@@ -333,97 +729,43 @@ int main(int argc, char *argv[])
 
     init_logging(argv[0], daemonize);
 
-    syslog(LOG_USER|LOG_INFO, "Options parsed. simulation=%s target=%d,\n",
-	   sim_cmd, target);
-    syslog(LOG_USER|LOG_INFO, "sleep_time=%d, pump_time=%d, foreground=%s,\n",
-	   sleep_time, pump_time, ((!daemonize) ? "yes" : "no"));
+    syslog(LOG_USER|LOG_INFO, "Options parsed. simulation=%s zones=%d,\n",
+	   sim_cmd, mon.num_zones);
+    for (int i = 0; i < mon.num_zones; i++) {
+	p_zone = &mon.zones[i];
+	syslog(LOG_USER|LOG_INFO, "zone %d: sensor=%s gpio=%s target=%d,\n",
+	       i, p_zone->dev, p_zone->pin, p_zone->target);
+	syslog(LOG_USER|LOG_INFO, "zone %d: sleep_time=%d, pump_time=%d,\n",
+	       i, p_zone->sleep_time, p_zone->pump_time);
+    }
+    syslog(LOG_USER|LOG_INFO, "foreground=%s,\n", ((!daemonize) ? "yes" : "no"));
     if (mqtt_broker_uri) {
 	syslog(LOG_USER|LOG_INFO, "MQTT enabled, broker=%s.\n",
 	       mqtt_broker_uri);
-	mqtt_client_init(argv[0], &mqtt_client, mqtt_broker_uri);
+	mqtt_client_init(argv[0], &mon.mqtt_client, mqtt_broker_uri);
     } else {
 	syslog(LOG_USER|LOG_INFO, "MQTT disabled.\n");
     }
 
-    if ((soil_drv_fd = open(I2C_SOIL_DEV, O_RDWR)) == -1) {
-	perror(argv[0]);
-	exit(EXIT_FAILURE);
-    }
-
-    /* Set sim mode so we are in a known state */
-    if (write(soil_drv_fd, sim_cmd, sizeof(sim_cmd)) != sizeof(sim_cmd)) {
-	perror(argv[0]);
-	exit(EXIT_FAILURE);
-    }
-
-    /* Enable GPIO control - Any subsequent exits should call gpio_disable() */
-    if (gpio_enable() == GPIO_ERROR) {
-	perror(argv[0]);
-	exit(EXIT_FAILURE);
-    }
-
-    if (!(msgbuf = malloc(MQTT_MSG_BUFSIZE))) {
-	perror(argv[0]);
-	exit(EXIT_FAILURE);
+    if (!(mon.msgbuf = malloc(MQTT_MSG_BUFSIZE)) ||
+	((mon.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)) {
+	fatal(&mon);
     }
-
-    snprintf(msgbuf, MQTT_MSG_BUFSIZE, "Init done, entering main loop\n");
-    syslog(LOG_USER|LOG_INFO, msgbuf);
-    if (mqtt_broker_uri) {
-	mqtt_publish_msg(argv[0], mqtt_client, msgbuf);
+    watch_fd(&mon, mon.signal_fd, EV_SIGNAL, 0);
+    for (int i = 0; i < mon.num_zones; i++) {
+	init_zone(&mon, &mon.zones[i], sim_cmd);
     }
-    while (1) {
-	/* Read current moisture level */
-	if (read(soil_drv_fd, &current, sizeof(current)) != sizeof(current)) {
-	    perror(argv[0]);
-	    /* Disable GPIO control - ignore errors; exiting anyway */
-	    (void) gpio_disable();
-	    exit(EXIT_FAILURE);
-	}
-	snprintf(msgbuf, MQTT_MSG_BUFSIZE, "Current moisture=%d\n", current);
-	syslog(LOG_USER|LOG_INFO, msgbuf);
-	if (mqtt_broker_uri) {
-	    mqtt_publish_msg(argv[0], mqtt_client, msgbuf);
-	}
 
-	if (current < target) {
-	    if (gpio_on() == GPIO_ERROR) {
-		perror(argv[0]);
-		(void) gpio_disable();
-		exit(EXIT_FAILURE);
-	    }
-	    snprintf(msgbuf, MQTT_MSG_BUFSIZE, "Pump on, runtime=%d sec\n",
-		     pump_time);
-	    syslog(LOG_USER|LOG_INFO, msgbuf);
-	    if (mqtt_broker_uri) {
-		mqtt_publish_msg(argv[0], mqtt_client, msgbuf);
-	    }
-	    /*
-	     * Technically, we should check the return value from
-	     * sleep.  Non-zero means sleep was interupted by a
-	     * signal, but we exit on any signals (either gracefully
-	     * if caught, or non- gracefully if ignored), so partial
-	     * sleeps can't happen here.
-	     */
-	    (void) sleep(pump_time);
-	    if (gpio_off() == GPIO_ERROR) {
-		perror(argv[0]);
-		(void) gpio_disable();
-		exit(EXIT_FAILURE);
-	    }
-	    snprintf(msgbuf, MQTT_MSG_BUFSIZE, "Pump off\n");
-	    syslog(LOG_USER|LOG_INFO, msgbuf);
-	    if (mqtt_broker_uri) {
-		mqtt_publish_msg(argv[0], mqtt_client, msgbuf);
-	    }
+    log_msg(&mon, "Init done, entering main loop\n");
 
-	}
-	snprintf(msgbuf, MQTT_MSG_BUFSIZE, "Sleeping for %d sec\n",
-		 sleep_time);
-	syslog(LOG_USER|LOG_INFO, msgbuf);
-	if (mqtt_broker_uri) {
-	    mqtt_publish_msg(argv[0], mqtt_client, msgbuf);
-	}
-	sleep(sleep_time);
+    /*
+     * One reading per zone at startup, as before, so a dry zone is
+     * watered now rather than at the first boundary; every later
+     * reading is on a boundary. SIGUSR1 takes one in between.
+     */
+    for (int i = 0; i < mon.num_zones; i++) {
+	read_sensor(&mon, &mon.zones[i]);
+	arm_sample_timer(&mon, &mon.zones[i]);
     }
+    run_loop(&mon);
 }